@@ -40,6 +40,19 @@ class aabb {
             return x;
         }
 
+        point3 centroid() const {
+            return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+        }
+
+        double surface_area() const {
+            auto dx = x.size(), dy = y.size(), dz = z.size();
+            return 2 * (dx*dy + dy*dz + dz*dx);
+        }
+
+        bool is_empty() const {
+            return x.min > x.max || y.min > y.max || z.min > z.max;
+        }
+
         bool hit(const ray& r, interval ray_t) const {
             for (int a = 0; a < 3; a++) {
                 auto invD = 1 / r.direction()[a];
@@ -60,6 +73,13 @@ class aabb {
         }
 };
 
+inline aabb intersection(const aabb& a, const aabb& b) {
+    // The box common to a and b; empty if they do not overlap.
+    return aabb(interval(fmax(a.x.min, b.x.min), fmin(a.x.max, b.x.max)),
+                interval(fmax(a.y.min, b.y.min), fmin(a.y.max, b.y.max)),
+                interval(fmax(a.z.min, b.z.min), fmin(a.z.max, b.z.max)));
+}
+
 aabb operator+(const aabb& bbox, const vec3& offset) {
     return aabb(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
 }
@@ -0,0 +1,143 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+class affine {
+    public:
+        // A 4x4 affine transform. Only the top three rows are stored; the bottom row is
+        // always 0 0 0 1. Points take the translation, vectors do not, and normals go through
+        // the transpose of the inverse, so they stay perpendicular under non-uniform scaling.
+        double m[3][4];
+
+        affine() : m{{1,0,0,0}, {0,1,0,0}, {0,0,1,0}} {}
+
+        static affine translation(const vec3& offset) {
+            affine t;
+            for (int i = 0; i < 3; i++) t.m[i][3] = offset[i];
+            return t;
+        }
+
+        static affine scaling(const vec3& factors) {
+            affine t;
+            for (int i = 0; i < 3; i++) t.m[i][i] = factors[i];
+            return t;
+        }
+
+        static affine rotation(const vec3& axis, double angle) {
+            // Rotates by angle degrees, counter-clockwise looking down axis.
+            auto a = unit_vector(axis);
+            auto radians = degrees_to_radians(angle);
+            auto s = sin(radians);
+            auto c = cos(radians);
+
+            affine t;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++)
+                    t.m[i][j] = a[i] * a[j] * (1 - c) + (i == j ? c : 0);
+            }
+
+            t.m[0][1] -= a[2] * s;  t.m[1][0] += a[2] * s;
+            t.m[0][2] += a[1] * s;  t.m[2][0] -= a[1] * s;
+            t.m[1][2] -= a[0] * s;  t.m[2][1] += a[0] * s;
+            return t;
+        }
+
+        static affine rotation_y(double angle) {
+            auto radians = degrees_to_radians(angle);
+            auto s = sin(radians);
+            auto c = cos(radians);
+
+            affine t;
+            t.m[0][0] = c;   t.m[0][2] = s;
+            t.m[2][0] = -s;  t.m[2][2] = c;
+            return t;
+        }
+
+        point3 point(const point3& p) const {
+            return point3(
+                m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+        }
+
+        vec3 vector(const vec3& v) const {
+            return vec3(
+                m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+        }
+
+        vec3 normal(const vec3& n) const {
+            // Multiplies by the transpose. Called on the inverse transform, this carries a
+            // normal the same way as the transform carries points. The result is not unit length.
+            return vec3(
+                m[0][0]*n[0] + m[1][0]*n[1] + m[2][0]*n[2],
+                m[0][1]*n[0] + m[1][1]*n[1] + m[2][1]*n[2],
+                m[0][2]*n[0] + m[1][2]*n[1] + m[2][2]*n[2]);
+        }
+
+        aabb box(const aabb& b) const {
+            // The bounds of the transformed box (Arvo 1990): per output axis, each input axis
+            // adds whichever end of its interval gives the smaller and the larger value.
+            interval axes[3];
+
+            for (int i = 0; i < 3; i++) {
+                auto lo = m[i][3], hi = m[i][3];
+
+                for (int j = 0; j < 3; j++) {
+                    if (m[i][j] == 0) continue;
+                    auto a = m[i][j] * b.axis(j).min;
+                    auto c = m[i][j] * b.axis(j).max;
+                    lo += fmin(a, c);
+                    hi += fmax(a, c);
+                }
+
+                axes[i] = interval(lo, hi);
+            }
+
+            return aabb(axes[0], axes[1], axes[2]);
+        }
+
+        affine inverse() const {
+            // The inverse of the 3x3 part from its cofactors, then the translation undone.
+            affine r;
+
+            r.m[0][0] = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+            r.m[0][1] = m[0][2]*m[2][1] - m[0][1]*m[2][2];
+            r.m[0][2] = m[0][1]*m[1][2] - m[0][2]*m[1][1];
+            r.m[1][0] = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+            r.m[1][1] = m[0][0]*m[2][2] - m[0][2]*m[2][0];
+            r.m[1][2] = m[0][2]*m[1][0] - m[0][0]*m[1][2];
+            r.m[2][0] = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+            r.m[2][1] = m[0][1]*m[2][0] - m[0][0]*m[2][1];
+            r.m[2][2] = m[0][0]*m[1][1] - m[0][1]*m[1][0];
+
+            auto det = m[0][0]*r.m[0][0] + m[0][1]*r.m[1][0] + m[0][2]*r.m[2][0];
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) r.m[i][j] /= det;
+            }
+
+            for (int i = 0; i < 3; i++)
+                r.m[i][3] = -(r.m[i][0]*m[0][3] + r.m[i][1]*m[1][3] + r.m[i][2]*m[2][3]);
+
+            return r;
+        }
+};
+
+inline affine operator*(const affine& a, const affine& b) {
+    // The transform that applies b, then a.
+    affine r;
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+            if (j == 3) r.m[i][j] += a.m[i][3];
+        }
+    }
+
+    return r;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,180 @@
+#ifndef BOX_H
+#define BOX_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <utility>
+
+class box : public hittable {
+    public:
+        // The axis-aligned box that has a and b as opposite corners, as one primitive: a single
+        // slab test finds where a ray enters and leaves it, and which faces it crosses there.
+        box(const point3& a, const point3& b, shared_ptr<material> m) : mat(m) {
+            lower = point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
+            upper = point3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z()));
+            bbox = aabb(lower, upper).pad();
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            interval span;
+            int entry_face, exit_face;
+            if (!slabs(r, span, entry_face, exit_face)) return false;
+
+            // Rays that start inside, like the quads' other sides, hit where they leave.
+            if (ray_t.contains(span.min)) {
+                rec.t = span.min;
+                rec.primitive = entry_face;
+            } else if (ray_t.contains(span.max)) {
+                rec.t = span.max;
+                rec.primitive = exit_face;
+            } else {
+                return false;
+            }
+
+            rec.object = this;
+            return true;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            interval span;
+            int entry_face, exit_face;
+            return slabs(r, span, entry_face, exit_face) && (ray_t.contains(span.min) || ray_t.contains(span.max));
+        }
+
+        void finalize_hit(const ray& r, hit_record& rec) const override {
+            // Faces are numbered 2 * axis, plus 1 on the upper side. u and v run from 0 to 1
+            // across each face, along the axes noted.
+            rec.p = r.at(rec.t);
+            rec.mat = mat.get();
+
+            auto axis = rec.primitive / 2;
+            auto side = rec.primitive % 2;
+            vec3 outward_normal;
+            outward_normal[axis] = side ? 1 : -1;
+            rec.set_face_normal(r, outward_normal);
+
+            auto along = [&](int a) { return (rec.p[a] - lower[a]) / (upper[a] - lower[a]); };
+            switch (rec.primitive) {
+                case 0: rec.u = along(2);     rec.v = along(1);     break;  // left
+                case 1: rec.u = 1 - along(2); rec.v = along(1);     break;  // right
+                case 2: rec.u = along(0);     rec.v = along(2);     break;  // bottom
+                case 3: rec.u = along(0);     rec.v = 1 - along(2); break;  // top
+                case 4: rec.u = 1 - along(0); rec.v = along(1);     break;  // back
+                default: rec.u = along(0);    rec.v = along(1);     break;  // front
+            }
+        }
+
+        bool entry_exit(const ray& r, interval& span) const override {
+            int entry_face, exit_face;
+            return slabs(r, span, entry_face, exit_face);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        aabb clip_box(const aabb& region) const override { return intersection(bbox, region); }
+
+        double pdf_value(const point3& origin, const vec3& direction) const override {
+            // As a light, the box is sampled by area over the faces origin can see, so the
+            // density is the distance squared over the cosine and those faces' total area.
+            hit_record rec;
+            if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec)) return 0;
+
+            double areas[6];
+            auto total = visible_faces(origin, areas);
+            if (areas[rec.primitive] == 0) return 0;
+
+            auto distance_squared = rec.t * rec.t * direction.length_squared();
+            auto cosine = fabs(direction[rec.primitive / 2]) / direction.length();
+
+            return distance_squared / (cosine * total);
+        }
+
+        vec3 random(const point3& origin, sampler& s) const override {
+            double areas[6];
+            auto total = visible_faces(origin, areas);
+            auto p = s.get_2d();
+            if (total == 0) return (lower + upper) / 2 - origin;
+
+            // p.x picks a face in proportion to its area and is then stretched back over that
+            // face, which keeps the sample's stratification.
+            auto x = p.x * total;
+            int face = 0;
+            for (int f = 0; f < 6; f++) {
+                if (areas[f] == 0) continue;
+                face = f;
+                if (x < areas[f]) break;
+                x -= areas[f];
+            }
+
+            auto a = face / 2;
+            auto b = (a + 1) % 3;
+            auto c = (a + 2) % 3;
+
+            point3 on_face;
+            on_face[a] = (face % 2) ? upper[a] : lower[a];
+            on_face[b] = lower[b] + fmin(x / areas[face], 1.0) * (upper[b] - lower[b]);
+            on_face[c] = lower[c] + p.y * (upper[c] - lower[c]);
+            return on_face - origin;
+        }
+
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            if (mat->is_emitter()) lights.push_back(this);
+        }
+
+    private:
+        point3 lower, upper;
+        shared_ptr<material> mat;
+        aabb bbox;
+
+        double visible_faces(const point3& origin, double* areas) const {
+            // Writes the area of each face that origin sees from outside the box, 0 for the
+            // others; from inside, it sees all six. Returns their sum.
+            auto extent = upper - lower;
+            double face_area[3] = { extent.y() * extent.z(), extent.z() * extent.x(), extent.x() * extent.y() };
+            bool inside = true;
+
+            for (int a = 0; a < 3; a++) {
+                areas[2*a] = (origin[a] < lower[a]) ? face_area[a] : 0;
+                areas[2*a + 1] = (origin[a] > upper[a]) ? face_area[a] : 0;
+                if (origin[a] < lower[a] || origin[a] > upper[a]) inside = false;
+            }
+
+            double total = 0;
+            for (int f = 0; f < 6; f++) {
+                if (inside) areas[f] = face_area[f / 2];
+                total += areas[f];
+            }
+
+            return total;
+        }
+
+        bool slabs(const ray& r, interval& span, int& entry_face, int& exit_face) const {
+            // The distances along r where it enters and leaves the box, and the faces it
+            // crosses there: the latest of the slabs' entries and the earliest of their exits.
+            span = interval::universe;
+            entry_face = exit_face = 0;
+
+            for (int a = 0; a < 3; a++) {
+                auto inv = 1 / r.direction()[a];
+                auto t0 = (lower[a] - r.origin()[a]) * inv;
+                auto t1 = (upper[a] - r.origin()[a]) * inv;
+                auto near_side = inv < 0 ? 1 : 0;
+                if (inv < 0) std::swap(t0, t1);
+
+                if (t0 > span.min) {
+                    span.min = t0;
+                    entry_face = 2 * a + near_side;
+                }
+                if (t1 < span.max) {
+                    span.max = t1;
+                    exit_face = 2 * a + 1 - near_side;
+                }
+            }
+
+            return span.min <= span.max;
+        }
+};
+
+#endif
\ No newline at end of file
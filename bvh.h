@@ -4,76 +4,1071 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "primitive.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+
+inline void collect_unique_lights(const std::vector<shared_ptr<hittable>>& objects,
+                                  std::vector<const hittable*>& lights) {
+    // A tree with spatial splits can reference one object from several leaves; each light is
+    // added once, or light sampling would favour it.
+    auto first = lights.size();
+    for (const auto& object : objects) object->collect_lights(lights);
+
+    std::unordered_set<const hittable*> seen(lights.begin(), lights.begin() + first);
+    auto out = lights.begin() + first;
+    for (auto light = out; light != lights.end(); ++light)
+        if (seen.insert(*light).second) *out++ = *light;
+    lights.erase(out, lights.end());
+}
+
+struct bvh_stats {
+    // Quality of a built tree. sah_cost is the expected cost of tracing a ray through it,
+    // counting each node by the fraction of the root's surface area it covers.
+    // overlap sums the area shared by each interior node's children, in the same units; it is
+    // roughly how many extra nodes a ray visits because siblings overlap. Spatial splits lower
+    // it by putting an object in more than one leaf, so references can exceed primitives.
+    double sah_cost = 0;
+    double overlap = 0;
+    size_t nodes = 0;
+    size_t leaves = 0;
+    size_t primitives = 0;
+    size_t references = 0;
+    int depth = 0;
+    std::vector<size_t> leaf_sizes;   // leaf_sizes[n] = number of leaves holding n references
+
+    void print(std::ostream& out) const {
+        out << "BVH: " << primitives << " primitives (" << references << " references), " << nodes
+            << " nodes (" << leaves << " leaves), depth " << depth << ", SAH cost " << sah_cost
+            << ", overlap " << overlap << '\n';
+
+        out << "Leaf sizes:";
+        for (size_t i = 0; i < leaf_sizes.size(); i++)
+            if (leaf_sizes[i]) out << ' ' << i << ':' << leaf_sizes[i];
+        out << '\n';
+    }
+};
 
 class bvh_node : public hittable {
     public:
+        // The tree is stored flat: nodes in depth-first order, so an interior node's first
+        // child is the next node and only the second child needs an index, and the leaves'
+        // primitives in one array in the order the leaves reference them.
         bvh_node(const hittable_list& list)
             : bvh_node(list.objects, 0, list.objects.size()) {}
 
         bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end) {
-            // Create a modifiable array of the source scene objects
-            auto objects = src_objects;
-
-            int axis = random_int(0,2);
-            auto comparator = (axis == 0) ? box_x_compare
-                            : (axis == 1) ? box_y_compare
-                                          : box_z_compare;
-            
-            size_t object_span = end - start;
-
-            if (object_span == 1) {
-                left = right = objects[start];
-            } else if (object_span == 2) {
-                if (comparator(objects[start], objects[start+1])) {
-                    left = objects[start];
-                    right = objects[start+1];
-                } else {
-                    left = objects[start+1];
-                    right = objects[start];
+            build_sah(src_objects, start, end);
+            finish_build();
+        }
+
+        bvh_node(const hittable_list& list, thread_pool& pool) {
+            // Builds on the pool's workers. Large lists get a linear BVH: primitives sorted
+            // along a Morton curve, cut into treelets that are built in parallel, with the
+            // levels above the treelets built by the surface area heuristic (HLBVH). Lists
+            // too small to be worth it get the serial SAH build.
+            if (list.objects.size() < parallel_build_threshold || !build_lbvh(list.objects, pool))
+                build_sah(list.objects, 0, list.objects.size());
+            finish_build();
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (nodes.empty()) return false;
+
+            ray_slopes slopes(r);
+            uint32_t stack[max_depth];
+            int top = 0;
+            uint32_t index = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                const auto& node = nodes[index];
+
+                if (slopes.hit(node, ray_t)) {
+                    if (node.count > 0) {
+                        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                            if (primitives[i].hit(r, ray_t, rec)) {
+                                hit_anything = true;
+                                ray_t.max = rec.t;
+                            }
+                        }
+                    } else {
+                        // Visit the child on the near side of the split first, so a hit there
+                        // can cull the far one.
+                        if (slopes.negative[node.axis]) {
+                            stack[top++] = index + 1;
+                            index = node.offset;
+                        } else {
+                            stack[top++] = node.offset;
+                            index = index + 1;
+                        }
+                        continue;
+                    }
                 }
-            } else {
-                std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
-                auto mid = start + object_span / 2;
-                left = make_shared<bvh_node>(objects, start, mid);
-                right = make_shared<bvh_node>(objects, mid, end);
+                if (top == 0) break;
+                index = stack[--top];
             }
 
-            bbox = aabb(left->bounding_box(), right->bounding_box());
+            return hit_anything;
         }
-        
-        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            if (!bbox.hit(r, ray_t)) return false;
 
-            bool hit_left = left->hit(r, ray_t, rec);
-            bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
 
-            return hit_left || hit_right;
+            ray_slopes slopes(r);
+            uint32_t stack[max_depth];
+            int top = 0;
+            uint32_t index = 0;
+
+            while (true) {
+                const auto& node = nodes[index];
+
+                if (slopes.hit(node, ray_t)) {
+                    if (node.count > 0) {
+                        for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                            if (primitives[i].occluded(r, ray_t)) return true;
+                    } else {
+                        stack[top++] = node.offset;
+                        index = index + 1;
+                        continue;
+                    }
+                }
+
+                if (top == 0) break;
+                index = stack[--top];
+            }
+
+            return false;
         }
 
         aabb bounding_box() const override { return bbox; }
 
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            collect_unique_lights(objects, lights);
+        }
+
+        bool refit(thread_pool& pool) {
+            // Brings every node's bounds up to date after objects have moved, bottom up: the
+            // subtrees below the top few levels in parallel, then the levels above them. The
+            // topology stays, so the tree degrades as objects drift apart; once its SAH cost
+            // passes rebuild_ratio times the cost it was built with, it is rebuilt instead, and
+            // refit returns true. Trees derived from this one are copies; derive them again.
+            if (nodes.empty()) return false;
+
+            int split_depth = 0;
+            while ((size_t(1) << split_depth) < static_cast<size_t>(pool.size()) * 8) split_depth++;
+
+            std::vector<uint32_t> subtrees;
+            collect_subtrees(0, 0, split_depth, subtrees);
+
+            pool.parallel_for(subtrees.size(), [&](size_t s, int) {
+                // A subtree is a contiguous run of nodes with the children after their parent,
+                // so one backwards pass visits children first.
+                auto root = subtrees[s];
+                for (auto i = subtree_end(root); i-- > root;) refit_node(i);
+            });
+
+            refit_top(0, 0, split_depth);
+            bbox = node_box(nodes[0]);
+
+            if (tree_cost() <= rebuild_ratio * built_cost) return false;
+
+            // Spatial splits may have put an object in several leaves; rebuild from each once.
+            std::vector<shared_ptr<hittable>> unique;
+            std::unordered_set<const hittable*> seen;
+            for (const auto& object : objects)
+                if (seen.insert(object.get()).second) unique.push_back(object);
+
+            nodes.clear();
+            objects.clear();
+            bbox = aabb();
+
+            if (unique.size() < parallel_build_threshold || !build_lbvh(unique, pool))
+                build_sah(unique, 0, unique.size());
+            finish_build();
+            return true;
+        }
+
+        template <typename Pack>
+        void collapse_leaves(size_t width, double packed_cost, Pack pack) {
+            // Makes subtrees of at most width primitives single leaves, holding whatever
+            // pack(primitives) returns for them: the leaf's primitives packed into batches, say.
+            // Each object pack returns is costed at packed_cost intersections, and a subtree is
+            // collapsed only when that is cheaper than its own SAH cost; otherwise its children
+            // are tried. The node boxes stay as they were. Objects the pack makes are fixed
+            // copies, so refit does not see their primitives move.
+            if (nodes.empty()) return;
+
+            // Children come after their parents, so a backwards pass counts them first. The
+            // costs are in units of the root's area, like node_cost's.
+            std::vector<size_t> sizes(nodes.size());
+            std::vector<double> costs(nodes.size());
+            auto root_area = node_area(nodes[0]);
+            auto area_ratio = [&](uint32_t i) { return root_area > 0 ? node_area(nodes[i]) / root_area : 1.0; };
+
+            for (size_t i = nodes.size(); i-- > 0;) {
+                const auto& node = nodes[i];
+                sizes[i] = node.count > 0 ? node.count : sizes[i + 1] + sizes[node.offset];
+                costs[i] = node_cost(area_ratio(static_cast<uint32_t>(i)), node.count);
+                if (node.count == 0) costs[i] += costs[i + 1] + costs[node.offset];
+            }
+
+            std::vector<linear_node> collapsed;
+            std::vector<shared_ptr<hittable>> packed;
+            collapsed.reserve(nodes.size());
+            packed.reserve(objects.size());
+
+            auto emit = [&](auto& self, uint32_t index) -> uint32_t {
+                auto out = static_cast<uint32_t>(collapsed.size());
+                collapsed.push_back(nodes[index]);
+
+                if (sizes[index] <= width) {
+                    // Spatial splits can put an object in more than one of the subtree's leaves.
+                    std::vector<shared_ptr<hittable>> prims;
+                    gather_leaves(index, prims);
+                    std::unordered_set<const hittable*> seen;
+                    prims.erase(std::remove_if(prims.begin(), prims.end(),
+                        [&](const shared_ptr<hittable>& p) { return !seen.insert(p.get()).second; }), prims.end());
+
+                    auto leaf = pack(prims);
+                    auto leaf_cost = area_ratio(index) * intersection_cost * packed_cost * leaf.size();
+
+                    if (nodes[index].count > 0 || leaf_cost < costs[index]) {
+                        collapsed[out].offset = static_cast<uint32_t>(packed.size());
+                        collapsed[out].count = static_cast<uint16_t>(leaf.size());
+                        packed.insert(packed.end(), leaf.begin(), leaf.end());
+                        return out;
+                    }
+                }
+
+                self(self, index + 1);
+                collapsed[out].offset = self(self, nodes[index].offset);
+                return out;
+            };
+
+            emit(emit, 0);
+            nodes.swap(collapsed);
+            objects.swap(packed);
+            finish_build();
+        }
+
+        bvh_stats stats() const {
+            bvh_stats s;
+            if (!nodes.empty()) accumulate_stats(s, 0, 1, node_area(nodes[0]));
+
+            std::unordered_set<const hittable*> unique;
+            for (const auto& object : objects) unique.insert(object.get());
+            s.primitives = unique.size();
+            return s;
+        }
+
+        struct alignas(32) linear_node {
+            float lower[3];     // Bounds, rounded outwards to float
+            float upper[3];
+            uint32_t offset;    // Leaf: first primitive. Interior: second child.
+            uint16_t count;     // Primitives in a leaf, 0 for an interior node
+            uint16_t axis;      // Interior: the split axis
+        };
+
+        static_assert(sizeof(linear_node) == 32, "bvh nodes should be half a cache line");
+
+        size_t node_bytes() const { return nodes.size() * sizeof(linear_node); }
+
+        // The flat tree and its primitives, for building other node layouts from this one.
+        const std::vector<linear_node>& tree_nodes() const { return nodes; }
+        const std::vector<shared_ptr<hittable>>& tree_objects() const { return objects; }
+        const std::vector<primitive_ref>& tree_primitives() const { return primitives; }
+
+        void set_direct_calls(bool on) {
+            // Whether the leaves call the primitive types they know directly or, all of them,
+            // through the vtable; the second is there to measure the first against.
+            direct_calls = on;
+            primitives = tag_primitives(objects, on);
+        }
+
+        static double node_cost(double area_ratio, size_t count) {
+            // A node's share of the SAH cost: the chance a ray reaches it (its area relative to
+            // the root's), times the work there.
+            return area_ratio * (count > 0 ? intersection_cost * count : traversal_cost);
+        }
+
+        // Float bounds that contain the double ones.
+        static float round_down(double x) {
+            auto f = static_cast<float>(x);
+            return (f > x) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+        }
+
+        static float round_up(double x) {
+            auto f = static_cast<float>(x);
+            return (f < x) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+        }
+
     private:
-        shared_ptr<hittable> left;
-        shared_ptr<hittable> right;
+        friend class lazy_bvh;
+        friend class triangle_mesh;
+
+        struct bvh_prim {
+            aabb box;
+            point3 centroid;
+            size_t index;
+        };
+
+        // Far distances are scaled up by the worst-case rounding of the slab arithmetic, so a
+        // ray that grazes a box (along a face, through a vertex on its edge) is never rejected.
+        static constexpr double slab_robust = 1 + 2 * 3 * 0x1p-53 / (1 - 3 * 0x1p-53);
+
+        struct ray_slopes {
+            // The ray terms the slab test needs, computed once per ray rather than per node.
+            double origin[3];
+            double inv_direction[3];
+            bool negative[3];
+
+            ray_slopes(const ray& r) {
+                for (int a = 0; a < 3; a++) {
+                    origin[a] = r.origin()[a];
+                    inv_direction[a] = 1 / r.direction()[a];
+                    negative[a] = inv_direction[a] < 0;
+                }
+            }
+
+            bool hit(const linear_node& node, interval ray_t) const {
+                for (int a = 0; a < 3; a++) {
+                    auto t0 = ((negative[a] ? node.upper[a] : node.lower[a]) - origin[a]) * inv_direction[a];
+                    auto t1 = ((negative[a] ? node.lower[a] : node.upper[a]) - origin[a]) * inv_direction[a] * slab_robust;
+
+                    if (t0 > ray_t.min) ray_t.min = t0;
+                    if (t1 < ray_t.max) ray_t.max = t1;
+
+                    if (ray_t.max <= ray_t.min) return false;
+                }
+
+                return true;
+            }
+        };
+
+        // Cost model for the surface area heuristic, relative to one primitive intersection.
+        static constexpr int bin_count = 16;
+        static constexpr size_t max_leaf_size = 4;
+        static constexpr double traversal_cost = 0.125;
+        static constexpr double intersection_cost = 1.0;
+
+        // Spatial splits are tried where an object split's children overlap by more than
+        // spatial_split_overlap of the root's area, while the references they add stay within
+        // spatial_split_budget of the primitive count.
+        static constexpr double spatial_split_overlap = 1e-5;
+        static constexpr double spatial_split_budget = 0.5;
+
+        // Linear BVH parameters: codes use 10 bits per axis, and the top treelet_bits of a code
+        // choose the primitive's treelet.
+        static constexpr size_t parallel_build_threshold = 1 << 14;
+        static constexpr int morton_bits = 30;
+        static constexpr int treelet_bits = 12;
+
+        // Traversal keeps a fixed stack, so below sah_depth_limit the builder only makes
+        // median splits; those halve the range and end within max_depth for any scene size.
+        static constexpr int max_depth = 64;
+        static constexpr int sah_depth_limit = 32;
+
+        // A refitted tree whose SAH cost has grown past this ratio of its cost when built is rebuilt.
+        static constexpr double rebuild_ratio = 1.5;
+
+        std::vector<linear_node> nodes;
+        std::vector<shared_ptr<hittable>> objects;
+        std::vector<primitive_ref> primitives;      // objects, tagged for the leaf loops
         aabb bbox;
+        double built_cost = 0;
+        bool direct_calls = true;
 
-        static bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index) {
-            return a->bounding_box().axis(axis_index).min < b->bounding_box().axis(axis_index).min;
+        void finish_build() {
+            primitives = tag_primitives(objects, direct_calls);
+            built_cost = tree_cost();
         }
 
-        static bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-            return box_compare(a, b, 0);
+        struct morton_prim {
+            uint32_t code;
+            uint32_t index;     // Into the primitive references
+        };
+
+        struct split_context {
+            // What spatial splits need: the objects, to clip references to a split plane, the
+            // root's area, and how many more references the budget allows.
+            const std::vector<shared_ptr<hittable>>& objects;
+            double root_area;
+            size_t budget;
+        };
+
+        struct spatial_plane {
+            int axis = -1;
+            double position = 0;
+            double cost = infinity;
+        };
+
+        struct lbvh_treelet {
+            size_t start, end;                  // Range of the sorted primitives
+            std::vector<linear_node> nodes;     // Second-child offsets are local to the treelet
+            int depth = 0;
+        };
+
+        void build_sah(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end) {
+            // The builder works on references to the objects, each carrying the object's box and
+            // centroid, and partitions that one array in place as it recurses. Where object
+            // splits leave children overlapping (large quads beside small objects, say), it can
+            // split space instead, clipping the references that cross the plane into two (SBVH).
+            std::vector<bvh_prim> prims;
+            prims.reserve(end - start);
+
+            for (size_t i = start; i < end; i++) {
+                auto box = src_objects[i]->bounding_box();
+                bbox = aabb(bbox, box);
+                prims.push_back({ box, box.centroid(), i });
+            }
+
+            if (prims.empty()) return;
+
+            nodes.reserve(2 * prims.size());
+            objects.reserve(prims.size());
+
+            split_context context = {
+                src_objects, bbox.surface_area(), static_cast<size_t>(spatial_split_budget * prims.size())
+            };
+
+            auto make_leaf = [&](uint32_t index, const std::vector<bvh_prim>& refs, size_t first, size_t last, int) {
+                nodes[index].offset = static_cast<uint32_t>(objects.size());
+                nodes[index].count = static_cast<uint16_t>(last - first);
+                for (size_t i = first; i < last; i++) objects.push_back(src_objects[refs[i].index]);
+            };
+
+            build(nodes, prims, 0, prims.size(), 1, max_leaf_size, make_leaf, &context);
         }
 
-        static bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-            return box_compare(a, b, 1);
+        bool build_lbvh(const std::vector<shared_ptr<hittable>>& src_objects, thread_pool& pool) {
+            // Returns false, leaving the node untouched, if the tree would be too deep to traverse.
+            auto n = src_objects.size();
+            auto chunks = std::min(n, static_cast<size_t>(pool.size()) * 8);
+
+            std::vector<bvh_prim> prims(n);
+            std::vector<aabb> chunk_bounds(chunks), chunk_centroids(chunks);
+
+            pool.parallel_for(chunks, [&](size_t c, int) {
+                for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; i++) {
+                    auto box = src_objects[i]->bounding_box();
+                    prims[i] = { box, box.centroid(), i };
+                    chunk_bounds[c] = aabb(chunk_bounds[c], box);
+                    chunk_centroids[c] = aabb(chunk_centroids[c], aabb(prims[i].centroid, prims[i].centroid));
+                }
+            });
+
+            aabb bounds, centroid_bounds;
+            for (size_t c = 0; c < chunks; c++) {
+                bounds = aabb(bounds, chunk_bounds[c]);
+                centroid_bounds = aabb(centroid_bounds, chunk_centroids[c]);
+            }
+
+            std::vector<morton_prim> codes(n);
+            pool.parallel_for(chunks, [&](size_t c, int) {
+                for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; i++)
+                    codes[i] = { morton_code(prims[i].centroid, centroid_bounds), static_cast<uint32_t>(i) };
+            });
+
+            radix_sort(codes, pool, chunks);
+
+            std::vector<lbvh_treelet> treelets;
+            for (size_t start = 0, end; start < n; start = end) {
+                auto key = codes[start].code >> (morton_bits - treelet_bits);
+                for (end = start + 1; end < n && codes[end].code >> (morton_bits - treelet_bits) == key; end++) {}
+                treelets.push_back({ start, end, {}, 0 });
+            }
+
+            std::vector<shared_ptr<hittable>> sorted(n);
+            pool.parallel_for(treelets.size(), [&](size_t t, int) {
+                auto& treelet = treelets[t];
+                for (size_t i = treelet.start; i < treelet.end; i++) sorted[i] = src_objects[codes[i].index];
+
+                treelet.nodes.reserve(2 * (treelet.end - treelet.start));
+                build_treelet(treelet, codes, prims, treelet.start, treelet.end, morton_bits - treelet_bits - 1, 1);
+            });
+
+            // The levels above the treelets, by SAH over the treelets' boxes. Each leaf of this
+            // top tree becomes a treelet's root, with room left after it for the treelet's nodes.
+            std::vector<bvh_prim> roots(treelets.size());
+            for (size_t t = 0; t < treelets.size(); t++) {
+                auto box = node_box(treelets[t].nodes[0]);
+                roots[t] = { box, box.centroid(), t };
+            }
+
+            std::vector<std::pair<uint32_t, size_t>> placements;
+            int depth = 0;
+
+            auto make_leaf = [&](uint32_t index, const std::vector<bvh_prim>& refs, size_t first, size_t, int leaf_depth) {
+                auto t = refs[first].index;
+                placements.push_back({ index, t });
+                depth = std::max(depth, leaf_depth - 1 + treelets[t].depth);
+                nodes.resize(index + treelets[t].nodes.size());
+            };
+
+            build(nodes, roots, 0, roots.size(), 1, 1, make_leaf, nullptr);
+
+            if (depth > max_depth) {
+                nodes.clear();
+                return false;
+            }
+
+            pool.parallel_for(placements.size(), [&](size_t p, int) {
+                auto base = placements[p].first;
+                const auto& treelet = treelets[placements[p].second];
+
+                for (size_t i = 0; i < treelet.nodes.size(); i++) {
+                    auto node = treelet.nodes[i];
+                    if (node.count == 0) node.offset += base;
+                    nodes[base + i] = node;
+                }
+            });
+
+            objects = std::move(sorted);
+            bbox = bounds;
+            return true;
         }
 
-        static bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-            return box_compare(a, b, 2);
+        static size_t split_point(const std::vector<morton_prim>& codes, size_t start, size_t end, int& bit) {
+            // Finds the highest bit where the range's codes differ and returns where the codes
+            // with it set begin; they are sorted, so those are the upper part of the range.
+            // Returns start if every code is the same.
+            for (; bit >= 0; bit--) {
+                auto mask = 1u << bit;
+                if ((codes[start].code & mask) == (codes[end-1].code & mask)) continue;
+
+                return std::partition_point(codes.begin() + start, codes.begin() + end,
+                    [mask](const morton_prim& m) { return !(m.code & mask); }) - codes.begin();
+            }
+
+            return start;
+        }
+
+        uint32_t build_treelet(lbvh_treelet& treelet, const std::vector<morton_prim>& codes,
+                               const std::vector<bvh_prim>& prims, size_t start, size_t end, int bit, int depth) {
+            auto index = static_cast<uint32_t>(treelet.nodes.size());
+            treelet.nodes.emplace_back();
+            treelet.depth = std::max(treelet.depth, depth);
+
+            auto count = end - start;
+            auto mid = count > 1 ? split_point(codes, start, end, bit) : start;
+
+            if (mid == start && count > max_leaf_size) {
+                // Identical codes; halve the range rather than make an oversized leaf.
+                mid = start + count / 2;
+            }
+
+            if (mid == start) {
+                aabb box;
+                for (size_t i = start; i < end; i++) box = aabb(box, prims[codes[i].index].box);
+
+                auto node = make_node(box);
+                node.offset = static_cast<uint32_t>(start);
+                node.count = static_cast<uint16_t>(count);
+                treelet.nodes[index] = node;
+                return index;
+            }
+
+            auto first = build_treelet(treelet, codes, prims, start, mid, bit - 1, depth + 1);
+            auto second = build_treelet(treelet, codes, prims, mid, end, bit - 1, depth + 1);
+
+            // Code bits cycle z, y, x from the lowest up.
+            auto node = make_node(aabb(node_box(treelet.nodes[first]), node_box(treelet.nodes[second])));
+            node.offset = second;
+            node.axis = static_cast<uint16_t>(bit >= 0 ? 2 - bit % 3 : 0);
+            treelet.nodes[index] = node;
+            return index;
+        }
+
+        static void radix_sort(std::vector<morton_prim>& codes, thread_pool& pool, size_t chunks) {
+            // Least significant digit first, 8 bits a pass. Each chunk counts its digits, a prefix
+            // sum over (digit, chunk) gives every chunk its output positions, and the chunks
+            // scatter in parallel. Equal digits keep their order, so the sort is stable and the
+            // tree does not depend on the number of threads.
+            auto n = codes.size();
+            std::vector<morton_prim> sorted(n);
+            std::vector<size_t> offsets(chunks * 256);
+
+            for (int shift = 0; shift < morton_bits; shift += 8) {
+                std::fill(offsets.begin(), offsets.end(), 0);
+
+                pool.parallel_for(chunks, [&](size_t c, int) {
+                    auto* counts = &offsets[c * 256];
+                    for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; i++)
+                        counts[(codes[i].code >> shift) & 255]++;
+                });
+
+                size_t sum = 0;
+                for (size_t digit = 0; digit < 256; digit++) {
+                    for (size_t c = 0; c < chunks; c++) {
+                        auto count = offsets[c * 256 + digit];
+                        offsets[c * 256 + digit] = sum;
+                        sum += count;
+                    }
+                }
+
+                pool.parallel_for(chunks, [&](size_t c, int) {
+                    auto* next = &offsets[c * 256];
+                    for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; i++)
+                        sorted[next[(codes[i].code >> shift) & 255]++] = codes[i];
+                });
+
+                codes.swap(sorted);
+            }
+        }
+
+        static uint32_t morton_code(const point3& p, const aabb& bounds) {
+            uint32_t q[3];
+            for (int a = 0; a < 3; a++) {
+                const auto& extent = bounds.axis(a);
+                auto t = extent.size() > 0 ? (p[a] - extent.min) / extent.size() : 0.5;
+                q[a] = std::min(static_cast<uint32_t>(t * 1024), 1023u);
+            }
+
+            return (spread_bits(q[0]) << 2) | (spread_bits(q[1]) << 1) | spread_bits(q[2]);
+        }
+
+        static uint32_t spread_bits(uint32_t x) {
+            // Moves each of the low 10 bits of x to every third bit.
+            x = (x | (x << 16)) & 0x030000ff;
+            x = (x | (x <<  8)) & 0x0300f00f;
+            x = (x | (x <<  4)) & 0x030c30c3;
+            x = (x | (x <<  2)) & 0x09249249;
+            return x;
+        }
+
+        template <typename Leaf>
+        static uint32_t build(std::vector<linear_node>& nodes, std::vector<bvh_prim>& prims, size_t start,
+                              size_t end, int depth, size_t leaf_size, Leaf& make_leaf, split_context* context) {
+            // Emits the subtree for prims[start, end) depth first and returns its root. Leaves of
+            // up to leaf_size references are handed to make_leaf(node, prims, start, end, depth).
+            // Spatial splits are only considered with a context.
+            aabb bounds, centroid_bounds;
+            for (size_t i = start; i < end; i++) {
+                bounds = aabb(bounds, prims[i].box);
+                centroid_bounds = aabb(centroid_bounds, aabb(prims[i].centroid, prims[i].centroid));
+            }
+
+            auto index = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(make_node(bounds));
+
+            auto count = end - start;
+            auto mid = start;
+            int split_axis = longest_axis(centroid_bounds);
+
+            if (count > 1 && depth >= sah_depth_limit) {
+                auto axis = split_axis;
+                mid = start + count / 2;
+                std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+                    [axis](const bvh_prim& a, const bvh_prim& b) { return a.centroid[axis] < b.centroid[axis]; });
+            } else if (count > 1) {
+                int axis, split;
+                auto cost = find_split(prims, start, end, bounds, centroid_bounds, axis, split);
+
+                spatial_plane plane;
+                if (context && context->budget > 0 && split_overlap(prims, start, end, centroid_bounds, axis, split)
+                        > spatial_split_overlap * context->root_area)
+                    plane = find_spatial_split(prims, start, end, bounds, *context);
+
+                std::vector<bvh_prim> left, right;
+                if (plane.cost < cost && (count > leaf_size || plane.cost < intersection_cost * count)
+                        && split_references(prims, start, end, plane, *context, left, right)) {
+                    // The children's references are new arrays; this range is not used again.
+                    build(nodes, left, 0, left.size(), depth + 1, leaf_size, make_leaf, context);
+                    std::vector<bvh_prim>().swap(left);
+                    auto second = build(nodes, right, 0, right.size(), depth + 1, leaf_size, make_leaf, context);
+
+                    nodes[index].offset = second;
+                    nodes[index].axis = static_cast<uint16_t>(plane.axis);
+                    return index;
+                }
+
+                if (axis >= 0 && (count > leaf_size || cost < intersection_cost * count)) {
+                    split_axis = axis;
+                    auto first = prims.begin() + start;
+                    auto last = prims.begin() + end;
+                    mid = std::partition(first, last, [&](const bvh_prim& p) {
+                        return bin_of(p.centroid[axis], centroid_bounds.axis(axis)) < split;
+                    }) - prims.begin();
+                } else if (count > leaf_size) {
+                    // Every centroid is in the same place, so no plane separates them; halve the
+                    // range rather than make an oversized leaf.
+                    mid = start + count / 2;
+                }
+            }
+
+            if (mid == start) {
+                make_leaf(index, prims, start, end, depth);
+                return index;
+            }
+
+            build(nodes, prims, start, mid, depth + 1, leaf_size, make_leaf, context);
+            auto second = build(nodes, prims, mid, end, depth + 1, leaf_size, make_leaf, context);
+
+            nodes[index].offset = second;
+            nodes[index].axis = static_cast<uint16_t>(split_axis);
+            return index;
+        }
+
+        static double find_split(const std::vector<bvh_prim>& prims, size_t start, size_t end, const aabb& bounds,
+                          const aabb& centroid_bounds, int& best_axis, int& best_split) {
+            // Bins the centroids along each axis and sweeps the planes between bins, returning
+            // the cheapest split by the surface area heuristic. best_axis is -1 if no plane
+            // separates the primitives.
+            struct bin {
+                aabb box;
+                size_t count = 0;
+            };
+
+            auto inv_area = bounds.surface_area() > 0 ? 1 / bounds.surface_area() : 0.0;
+            auto best_cost = infinity;
+            best_axis = -1;
+            best_split = 0;
+
+            for (int axis = 0; axis < 3; axis++) {
+                const auto& extent = centroid_bounds.axis(axis);
+                if (extent.size() <= 0) continue;
+
+                bin bins[bin_count];
+                for (size_t i = start; i < end; i++) {
+                    auto& b = bins[bin_of(prims[i].centroid[axis], extent)];
+                    b.box = aabb(b.box, prims[i].box);
+                    b.count++;
+                }
+
+                double right_area[bin_count];
+                size_t right_count[bin_count];
+                aabb right_box;
+                size_t n = 0;
+                for (int b = bin_count - 1; b > 0; b--) {
+                    right_box = aabb(right_box, bins[b].box);
+                    n += bins[b].count;
+                    right_area[b] = n ? right_box.surface_area() : 0;
+                    right_count[b] = n;
+                }
+
+                aabb left_box;
+                n = 0;
+                for (int b = 1; b < bin_count; b++) {
+                    left_box = aabb(left_box, bins[b-1].box);
+                    n += bins[b-1].count;
+                    if (n == 0 || right_count[b] == 0) continue;
+
+                    auto cost = traversal_cost + intersection_cost * inv_area
+                              * (left_box.surface_area() * n + right_area[b] * right_count[b]);
+
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b;
+                    }
+                }
+            }
+
+            return best_cost;
+        }
+
+        static double split_overlap(const std::vector<bvh_prim>& prims, size_t start, size_t end,
+                                    const aabb& centroid_bounds, int axis, int split) {
+            // The surface area shared by the two sides of an object split; infinite if there
+            // is no object split to make.
+            if (axis < 0) return infinity;
+
+            aabb left, right;
+            for (size_t i = start; i < end; i++) {
+                auto& side = bin_of(prims[i].centroid[axis], centroid_bounds.axis(axis)) < split ? left : right;
+                side = aabb(side, prims[i].box);
+            }
+
+            auto common = intersection(left, right);
+            return common.is_empty() ? 0 : common.surface_area();
+        }
+
+        static spatial_plane find_spatial_split(const std::vector<bvh_prim>& prims, size_t start, size_t end,
+                                                const aabb& bounds, const split_context& context) {
+            // Bins space rather than centroids: each reference is clipped to every bin it
+            // crosses, and counts on the left of the planes after the bin it enters and on the
+            // right of the planes before the bin it leaves. Returns the cheapest plane by SAH.
+            struct bin {
+                aabb box;
+                size_t entries = 0;
+                size_t exits = 0;
+            };
+
+            auto inv_area = bounds.surface_area() > 0 ? 1 / bounds.surface_area() : 0.0;
+            spatial_plane best;
+
+            for (int axis = 0; axis < 3; axis++) {
+                const auto& extent = bounds.axis(axis);
+                if (extent.size() <= 0) continue;
+
+                auto plane = [&](int b) { return extent.min + extent.size() * b / bin_count; };
+
+                bin bins[bin_count];
+                for (size_t i = start; i < end; i++) {
+                    const auto& ref = prims[i];
+                    auto first = bin_of(ref.box.axis(axis).min, extent);
+                    auto last = bin_of(ref.box.axis(axis).max, extent);
+
+                    for (int b = first; b <= last; b++) {
+                        auto piece = ref.box;
+                        if (first != last) {
+                            auto slab = ref.box;
+                            slab_axis(slab, axis) = interval(fmax(plane(b), ref.box.axis(axis).min),
+                                                             fmin(plane(b + 1), ref.box.axis(axis).max));
+                            piece = context.objects[ref.index]->clip_box(slab);
+                        }
+                        bins[b].box = aabb(bins[b].box, piece);
+                    }
+
+                    bins[first].entries++;
+                    bins[last].exits++;
+                }
+
+                double right_area[bin_count];
+                size_t right_count[bin_count];
+                aabb right_box;
+                size_t n = 0;
+                for (int b = bin_count - 1; b > 0; b--) {
+                    right_box = aabb(right_box, bins[b].box);
+                    n += bins[b].exits;
+                    right_area[b] = right_box.is_empty() ? 0 : right_box.surface_area();
+                    right_count[b] = n;
+                }
+
+                aabb left_box;
+                n = 0;
+                for (int b = 1; b < bin_count; b++) {
+                    left_box = aabb(left_box, bins[b-1].box);
+                    n += bins[b-1].entries;
+                    if (n == 0 || right_count[b] == 0) continue;
+
+                    auto left_area = left_box.is_empty() ? 0 : left_box.surface_area();
+                    auto cost = traversal_cost + intersection_cost * inv_area
+                              * (left_area * n + right_area[b] * right_count[b]);
+
+                    if (cost < best.cost) best = { axis, plane(b), cost };
+                }
+            }
+
+            return best;
+        }
+
+        static bool split_references(const std::vector<bvh_prim>& prims, size_t start, size_t end,
+                                     const spatial_plane& plane, split_context& context,
+                                     std::vector<bvh_prim>& left, std::vector<bvh_prim>& right) {
+            // Sends each reference to the side of the plane it lies on and clips those crossing
+            // it into a piece for each side. A crossing reference goes whole to one side instead
+            // where the SAH says that is cheaper (reference unsplitting; Stich et al. 2009).
+            // Returns false if a side would be empty or the budget would be exceeded.
+            struct crossing {
+                bvh_prim whole, left, right;
+            };
+
+            auto axis = plane.axis;
+            aabb left_box, right_box;
+            std::vector<crossing> crossings;
+
+            auto add = [](std::vector<bvh_prim>& side, aabb& side_box, const bvh_prim& ref, const aabb& box) {
+                side.push_back({ box, box.centroid(), ref.index });
+                side_box = aabb(side_box, box);
+            };
+
+            for (size_t i = start; i < end; i++) {
+                const auto& ref = prims[i];
+                const auto& extent = ref.box.axis(axis);
+
+                if (extent.max <= plane.position) {
+                    add(left, left_box, ref, ref.box);
+                } else if (extent.min >= plane.position) {
+                    add(right, right_box, ref, ref.box);
+                } else {
+                    auto lower = ref.box, upper = ref.box;
+                    slab_axis(lower, axis).max = plane.position;
+                    slab_axis(upper, axis).min = plane.position;
+
+                    const auto& object = *context.objects[ref.index];
+                    auto l = object.clip_box(lower);
+                    auto r = object.clip_box(upper);
+
+                    if (r.is_empty()) {
+                        add(left, left_box, ref, l);
+                    } else if (l.is_empty()) {
+                        add(right, right_box, ref, r);
+                    } else {
+                        crossings.push_back({ ref, { l, l.centroid(), ref.index }, { r, r.centroid(), ref.index } });
+                        left_box = aabb(left_box, l);
+                        right_box = aabb(right_box, r);
+                    }
+                }
+            }
+
+            auto n_left = static_cast<double>(left.size() + crossings.size());
+            auto n_right = static_cast<double>(right.size() + crossings.size());
+            size_t duplicates = 0;
+
+            for (const auto& c : crossings) {
+                auto split_cost = left_box.surface_area() * n_left + right_box.surface_area() * n_right;
+                auto left_cost = aabb(left_box, c.whole.box).surface_area() * n_left + right_box.surface_area() * (n_right - 1);
+                auto right_cost = left_box.surface_area() * (n_left - 1) + aabb(right_box, c.whole.box).surface_area() * n_right;
+
+                if (left_cost < split_cost && left_cost <= right_cost) {
+                    add(left, left_box, c.whole, c.whole.box);
+                    n_right--;
+                } else if (right_cost < split_cost) {
+                    add(right, right_box, c.whole, c.whole.box);
+                    n_left--;
+                } else {
+                    left.push_back(c.left);
+                    right.push_back(c.right);
+                    duplicates++;
+                }
+            }
+
+            if (left.empty() || right.empty() || duplicates > context.budget) {
+                left.clear();
+                right.clear();
+                return false;
+            }
+
+            context.budget -= duplicates;
+            return true;
+        }
+
+        static interval& slab_axis(aabb& box, int n) {
+            if (n == 1) return box.y;
+            if (n == 2) return box.z;
+            return box.x;
+        }
+
+        static int bin_of(double centroid, const interval& extent) {
+            auto b = static_cast<int>(bin_count * (centroid - extent.min) / extent.size());
+            return std::clamp(b, 0, bin_count - 1);
+        }
+
+        static int longest_axis(const aabb& box) {
+            if (box.x.size() >= box.y.size() && box.x.size() >= box.z.size()) return 0;
+            return box.y.size() >= box.z.size() ? 1 : 2;
+        }
+
+        static linear_node make_node(const aabb& box) {
+            linear_node node = {};
+            for (int a = 0; a < 3; a++) {
+                node.lower[a] = round_down(box.axis(a).min);
+                node.upper[a] = round_up(box.axis(a).max);
+            }
+            return node;
+        }
+
+        static aabb node_box(const linear_node& node) {
+            return aabb(interval(node.lower[0], node.upper[0]),
+                        interval(node.lower[1], node.upper[1]),
+                        interval(node.lower[2], node.upper[2]));
+        }
+
+        static double node_area(const linear_node& node) {
+            double dx = node.upper[0] - node.lower[0];
+            double dy = node.upper[1] - node.lower[1];
+            double dz = node.upper[2] - node.lower[2];
+            return 2 * (dx*dy + dy*dz + dz*dx);
+        }
+
+        double tree_cost() const {
+            // The SAH cost, as in stats(), without the rest of the statistics.
+            if (nodes.empty()) return 0;
+
+            auto root_area = node_area(nodes[0]);
+            double cost = 0;
+            for (const auto& node : nodes)
+                cost += node_cost(root_area > 0 ? node_area(node) / root_area : 1.0, node.count);
+
+            return cost;
+        }
+
+        void refit_node(uint32_t index) {
+            auto& node = nodes[index];
+
+            aabb box;
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    box = aabb(box, objects[i]->bounding_box());
+            } else {
+                box = aabb(node_box(nodes[index + 1]), node_box(nodes[node.offset]));
+            }
+
+            auto fitted = make_node(box);
+            std::copy(fitted.lower, fitted.lower + 3, node.lower);
+            std::copy(fitted.upper, fitted.upper + 3, node.upper);
+        }
+
+        void refit_top(uint32_t index, int depth, int split_depth) {
+            // The nodes above the subtrees that were refitted in parallel.
+            const auto& node = nodes[index];
+            if (depth == split_depth || node.count > 0) return;
+
+            refit_top(index + 1, depth + 1, split_depth);
+            refit_top(node.offset, depth + 1, split_depth);
+            refit_node(index);
+        }
+
+        void collect_subtrees(uint32_t index, int depth, int split_depth, std::vector<uint32_t>& roots) const {
+            const auto& node = nodes[index];
+            if (depth == split_depth || node.count > 0) {
+                roots.push_back(index);
+                return;
+            }
+
+            collect_subtrees(index + 1, depth + 1, split_depth, roots);
+            collect_subtrees(node.offset, depth + 1, split_depth, roots);
+        }
+
+        void gather_leaves(uint32_t index, std::vector<shared_ptr<hittable>>& prims) const {
+            const auto& node = nodes[index];
+            if (node.count > 0) {
+                prims.insert(prims.end(), objects.begin() + node.offset, objects.begin() + node.offset + node.count);
+                return;
+            }
+
+            gather_leaves(index + 1, prims);
+            gather_leaves(node.offset, prims);
+        }
+
+        uint32_t subtree_end(uint32_t index) const {
+            // One past the subtree's last node, its rightmost leaf.
+            while (nodes[index].count == 0) index = nodes[index].offset;
+            return index + 1;
+        }
+
+        void accumulate_stats(bvh_stats& s, uint32_t index, int depth, double root_area) const {
+            const auto& node = nodes[index];
+            auto area_ratio = root_area > 0 ? node_area(node) / root_area : 1.0;
+
+            s.nodes++;
+            s.depth = std::max(s.depth, depth);
+
+            if (node.count > 0) {
+                size_t n = node.count;
+                s.leaves++;
+                s.references += n;
+                if (s.leaf_sizes.size() <= n) s.leaf_sizes.resize(n + 1, 0);
+                s.leaf_sizes[n]++;
+                s.sah_cost += area_ratio * intersection_cost * n;
+                return;
+            }
+
+            s.sah_cost += area_ratio * traversal_cost;
+
+            auto common = intersection(node_box(nodes[index + 1]), node_box(nodes[node.offset]));
+            if (!common.is_empty() && root_area > 0) s.overlap += common.surface_area() / root_area;
+
+            accumulate_stats(s, index + 1, depth + 1, root_area);
+            accumulate_stats(s, node.offset, depth + 1, root_area);
         }
 };
 
@@ -7,15 +7,61 @@
 #include "rtweekend.h"
 
 #include "color.h"
+#include "framebuffer.h"
 #include "hittable.h"
 #include "material.h"
+#include "output_sink.h"
+#include "sampler.h"
 
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct path_stats {
+    // How many paths ended after each number of bounces, and why they ended.
+    std::vector<uint64_t> lengths;
+    uint64_t escaped = 0;       // Left the scene
+    uint64_t absorbed = 0;      // Hit a surface that does not scatter
+    uint64_t roulette = 0;      // Terminated by Russian roulette
+    uint64_t depth_limit = 0;   // Reached max_depth
+
+    path_stats(int max_depth = 0) : lengths(max_depth + 1, 0) {}
+
+    void merge(const path_stats& other) {
+        for (size_t i = 0; i < lengths.size() && i < other.lengths.size(); i++)
+            lengths[i] += other.lengths[i];
+
+        escaped += other.escaped;
+        absorbed += other.absorbed;
+        roulette += other.roulette;
+        depth_limit += other.depth_limit;
+    }
+
+    void print(std::ostream& out) const {
+        uint64_t paths = 0, bounces = 0;
+        for (size_t i = 0; i < lengths.size(); i++) {
+            paths += lengths[i];
+            bounces += i * lengths[i];
+        }
+        if (paths == 0) return;
 
-#if MT
-#include <execution>
-#include <thread>
-#endif
+        out << "Paths: " << paths << ", mean bounces " << static_cast<double>(bounces) / paths
+            << " (escaped " << escaped << ", absorbed " << absorbed
+            << ", roulette " << roulette << ", depth limit " << depth_limit << ")\n";
+
+        out << "Bounce histogram:";
+        for (size_t i = 0; i < lengths.size(); i++)
+            if (lengths[i]) out << ' ' << i << ':' << lengths[i];
+        out << '\n';
+    }
+};
 
 class camera {
     public:
@@ -23,6 +69,8 @@ class camera {
         int image_width = 100;
         int samples_per_pixel = 10;
         int max_depth = 10;
+        int russian_roulette_depth = 3;   // Bounces before Russian roulette may end a path
+        bool sample_lights = true;        // Next-event estimation toward the scene's emitters
         color background;
 
         double vfov = 90;
@@ -33,65 +81,99 @@ class camera {
         double defocus_angle = 0;
         double focus_dist = 10;
 
+        int threads = 0;      // Render threads (0 = one per hardware thread)
+        int tile_size = 16;   // Width and height of the square tiles handed to the workers
+        uint64_t seed = 0;    // A given seed renders the same image at any thread count
+        sampling sampler_type = sampling::sobol;
+
+        // Output image: .ppm (binary), .png, .hdr or .pfm. Empty writes a binary PPM to stdout.
+        std::string output_file;
+
+        // Adaptive sampling: after min_samples, keep sampling a pixel in rounds of
+        // adaptive_batch until the relative standard error of its luminance drops below
+        // adaptive_threshold, up to samples_per_pixel in total.
+        bool adaptive = false;
+        int min_samples = 16;
+        int adaptive_batch = 16;
+        double adaptive_threshold = 0.02;
+        std::string spp_map_file;   // If set, writes samples taken per pixel / samples_per_pixel
+
         void render(const hittable& world) {
             std::clog << "Starting the render\n";
 
             initialize();
 
-#if MT
-        std::vector<int> verticalIterator, horizontalIterator;
-        verticalIterator.resize(image_height);
-        horizontalIterator.resize(image_width);
-
-        for (int i = 0; i < image_height; i++) verticalIterator[i] = i;
-        for (int i = 0; i < image_width; i++) horizontalIterator[i] = i;
-
-        const int height = image_height;
-        const int width = image_width;
-        // vec3 colors[height][width];
-        
-        std::vector<std::vector<color>> colors(height, std::vector<color> (width));
-
-        std::for_each(std::execution::par, verticalIterator.begin(), verticalIterator.end(),
-        [&](int j) {
-            std::for_each(std::execution::par, horizontalIterator.begin(), horizontalIterator.end(),
-            [&](int i) {
-            // for (int i = 0; i < image_width; ++i) {
-                color pixel_color = get_pixel(world, i, j);
-                pixel_color = adjust_color(pixel_color, samples_per_pixel);
-                colors[j][i] += pixel_color;
-            // }
-            });
-        });
+            lights.clear();
+            if (sample_lights) world.collect_lights(lights);
+            std::clog << "Sampling " << lights.size() << " lights directly\n";
 
-#if WRITE
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            framebuffer image(image_width, image_height);
 
-        for (int j = 0; j < image_height; ++j) {
-            for (int i = 0; i < image_width; ++i) {
-                output_color(std::cout, colors[j][i]);
-            }
-        }
+#if WRITE
+            // Let any previous image finish writing before starting this one.
+            output.reset();
+            output = std::make_unique<output_sink>(output_file);
+            output->begin(image_width, image_height);
 #endif
-#else
-            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            auto tiles = make_tiles();
+            std::atomic<size_t> tiles_done(0);
+            std::atomic<uint64_t> samples_taken(0);
+            path_stats stats(max_depth);
+            std::mutex stats_mutex;
+
+            std::unique_ptr<thread_pool> own_pool;
+            if (!MT || threads > 0) own_pool = std::make_unique<thread_pool>(MT ? threads : 1);
+            thread_pool& pool = own_pool ? *own_pool : shared_thread_pool();
+            std::clog << "Rendering " << tiles.size() << " tiles on " << pool.size() << " threads\n";
+
+            pool.parallel_for(tiles.size(), [&](size_t t, int worker) {
+                const auto& tile = tiles[t];
+                auto view = image.tile(tile.x0, tile.y0, tile.x1, tile.y1);
+
+                uint64_t tile_samples = 0;
+                path_stats tile_stats(max_depth);
+                auto s = make_sampler(sampler_type, 0, samples_per_pixel);
+
+                for (int j = 0; j < view.height(); ++j) {
+                    for (int i = 0; i < view.width(); ++i) {
+                        render_pixel(world, view, i, j, tile.x0 + i, tile.y0 + j, *s, tile_stats);
+                        tile_samples += view.samples(i, j);
+                    }
+                }
 
-            for (int j = 0; j < image_height; ++j) {
-                std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-                for (int i = 0; i < image_width; ++i) {
-                    color pixel_color = get_pixel(world, i, j);
-                    write_color(std::cout, pixel_color, samples_per_pixel);
+                view.finish();
+                samples_taken += tile_samples;
+                {
+                    std::lock_guard<std::mutex> lock(stats_mutex);
+                    stats.merge(tile_stats);
                 }
-            }
-            
+
+#if WRITE
+                output->write_tile(image, tile.x0, tile.y0, tile.x1, tile.y1);
+#endif
+
+                auto finished = ++tiles_done;
+                if (worker == 0)
+                    std::clog << "\rTiles remaining: " << (tiles.size() - finished) << ' ' << std::flush;
+            });
+
             std::clog << "\nDone.\n";
+            std::clog << "Average samples per pixel: "
+                      << static_cast<double>(samples_taken) / (static_cast<double>(image_width) * image_height)
+                      << '\n';
+            stats.print(std::clog);
+
+#if WRITE
+            // The file is encoded in the background; the camera waits for it when it is
+            // destroyed or starts another render.
+            output->finish();
+
+            if (!spp_map_file.empty()) write_spp_map(image);
 #endif
         }
 
     private:
         int image_height;
-        int sqrt_spp;
-        double recip_sqrt_spp;
         point3 center;
         point3 pixel00_loc;
         vec3 pixel_delta_u;
@@ -99,6 +181,13 @@ class camera {
         vec3 u, v, w;
         vec3 defocus_disk_u;
         vec3 defocus_disk_v;
+        std::vector<const hittable*> lights;
+        std::unique_ptr<output_sink> output;
+        std::unique_ptr<output_sink> spp_output;
+
+        struct tile {
+            int x0, y0, x1, y1;
+        };
 
         void initialize() {
             image_height = static_cast<int>(image_width / aspect_ratio);
@@ -111,9 +200,6 @@ class camera {
             auto viewport_height = 2 * h * focus_dist;
             auto viewport_width = viewport_height * (static_cast<double>(image_width) / image_height);
 
-            sqrt_spp = static_cast<int>(sqrt(samples_per_pixel));
-            recip_sqrt_spp = 1.0 / sqrt_spp;
-            
             w = unit_vector(lookfrom - lookat);
             u = unit_vector(cross(vup, w));
             v = cross(w, u);
@@ -132,90 +218,245 @@ class camera {
             defocus_disk_v = v * defocus_radius;
         }
 
-        color get_pixel(const hittable& world, int x, int y) {
-            color pixel_color(0, 0, 0);
+        std::vector<tile> make_tiles() const {
+            // Cuts the image into tile_size squares and orders them along a Z-order (Morton)
+            // curve. The pool deals out contiguous runs of this list, so each worker starts on
+            // a compact block of neighbouring tiles rather than a strip across the image.
+            int size = (tile_size < 1) ? 1 : tile_size;
+            int tiles_x = (image_width + size - 1) / size;
+            int tiles_y = (image_height + size - 1) / size;
+
+            std::vector<std::pair<uint32_t, tile>> ordered;
+            ordered.reserve(static_cast<size_t>(tiles_x) * tiles_y);
+
+            for (int ty = 0; ty < tiles_y; ++ty) {
+                for (int tx = 0; tx < tiles_x; ++tx) {
+                    tile t { tx * size, ty * size,
+                             std::min((tx + 1) * size, image_width),
+                             std::min((ty + 1) * size, image_height) };
+                    ordered.emplace_back(morton_2d(tx, ty), t);
+                }
+            }
+
+            std::sort(ordered.begin(), ordered.end(),
+                [](const auto& a, const auto& b) { return a.first < b.first; });
+
+            std::vector<tile> tiles;
+            tiles.reserve(ordered.size());
+            for (const auto& entry : ordered) tiles.push_back(entry.second);
+
+            return tiles;
+        }
 
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                ray r = get_ray(x, y);
-                pixel_color += ray_color(r, max_depth, world);
+        static uint32_t morton_2d(uint32_t x, uint32_t y) {
+            // Interleaves the low 16 bits of x and y.
+            auto spread = [](uint32_t v) {
+                v &= 0x0000ffff;
+                v = (v | (v << 8)) & 0x00ff00ff;
+                v = (v | (v << 4)) & 0x0f0f0f0f;
+                v = (v | (v << 2)) & 0x33333333;
+                v = (v | (v << 1)) & 0x55555555;
+                return v;
+            };
+
+            return spread(x) | (spread(y) << 1);
+        }
+
+        void render_pixel(
+            const hittable& world, framebuffer::tile_view& view, int i, int j, int x, int y, sampler& s,
+            path_stats& stats
+        ) const {
+            // Samples pixel (x,y), which is (i,j) within the view, in one round or, when adaptive,
+            // in rounds until it converges. s is the tile's sampler, re-keyed here for the pixel;
+            // every round draws from it.
+            auto pixel_index = static_cast<uint64_t>(y) * image_width + x;
+            s.start_pixel(mix_bits(seed ^ mix_bits(pixel_index)));
+            int n = adaptive ? std::min(min_samples, samples_per_pixel) : samples_per_pixel;
+
+            while (n > 0) {
+                double m2;
+                color pixel_color = get_pixel(world, x, y, view.samples(i, j), n, s, m2, stats);
+                view.add_samples(i, j, pixel_color, n, m2);
+
+                if (!adaptive || view.relative_error(i, j) < adaptive_threshold) break;
+                n = std::min(adaptive_batch, samples_per_pixel - view.samples(i, j));
             }
+        }
+
+        void write_spp_map(const framebuffer& image) {
+            // Writes the fraction of samples_per_pixel each pixel took, as a linear grey image.
+            framebuffer map(image_width, image_height);
 
-            /*for (int s_j = 0; s_j < sqrt_spp; ++s_j) {
-                for (int s_i = 0; s_i < sqrt_spp; ++s_i) {
-                    ray r = get_ray(x, y, s_i, s_j);
-                    pixel_color += ray_color(r, max_depth, world);
+            for (int j = 0; j < image_height; ++j) {
+                for (int i = 0; i < image_width; ++i) {
+                    auto fraction = static_cast<double>(image.samples(i, j)) / samples_per_pixel;
+                    map.add_samples(i, j, color(fraction), 1);
                 }
-            }*/
+            }
 
-            return pixel_color;
+            spp_output = std::make_unique<output_sink>(spp_map_file, false);
+            spp_output->begin(image_width, image_height);
+            spp_output->write_tile(map, 0, 0, image_width, image_height);
+            spp_output->finish();
         }
 
-        ray get_ray(int i, int j) const {
-            auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-            auto pixel_sample = pixel_center + pixel_sample_square();
-
-            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
-            auto ray_direction = pixel_sample - ray_origin;
-            auto ray_time = random_double();
+        color get_pixel(
+            const hittable& world, int x, int y, int first, int n, sampler& s, double& m2, path_stats& stats
+        ) const {
+            // Takes samples first to first+n-1 of the pixel. Returns their sum and sets m2 to
+            // their luminance's Welford M2.
+            color pixel_color(0, 0, 0);
+            double mean = 0;
+            m2 = 0;
+
+            for (int sample = 0; sample < n; ++sample) {
+                s.start_sample(first + sample);
+                ray r = get_ray(x, y, s);
+                color sample_color = ray_color(r, world, s, stats);
+                pixel_color += sample_color;
+
+                auto l = luminance(sample_color);
+                auto delta = l - mean;
+                mean += delta / (sample + 1);
+                m2 += delta * (l - mean);
+            }
 
-            return ray(ray_origin, ray_direction, ray_time);
+            return pixel_color;
         }
 
-        ray get_ray(int i, int j, int s_i, int s_j) const {
+        ray get_ray(int i, int j, sampler& s) const {
+            // The sampler's first dimensions go to the pixel position, then the lens, then the
+            // time, whether or not the camera uses them, so every bounce starts on a fixed one.
             auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-            auto pixel_sample = pixel_center + pixel_sample_square(s_i, s_j);
+            auto pixel_sample = pixel_center + pixel_sample_square(s);
 
-            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+            auto lens_sample = defocus_disk_sample(s);
+            auto ray_origin = (defocus_angle <= 0) ? center : lens_sample;
             auto ray_direction = pixel_sample - ray_origin;
-            auto ray_time = random_double();
+            auto ray_time = s.get_1d();
 
             return ray(ray_origin, ray_direction, ray_time);
         }
 
-        vec3 pixel_sample_square() const {
-            auto px = -0.5 + random_double();
-            auto py = -0.5 + random_double();
-
-            return (px * pixel_delta_u) + (py * pixel_delta_v);
-        }
-
-        vec3 pixel_sample_square(int s_i, int s_j) const {
-            auto px = -0.5 + recip_sqrt_spp * (s_i + random_double());
-            auto py = -0.5 + recip_sqrt_spp * (s_j + random_double());
+        vec3 pixel_sample_square(sampler& s) const {
+            auto u = s.get_2d();
+            auto px = -0.5 + u.x;
+            auto py = -0.5 + u.y;
 
             return (px * pixel_delta_u) + (py * pixel_delta_v);
         }
 
-        point3 defocus_disk_sample() const {
+        point3 defocus_disk_sample(sampler& s) const {
             // Returns a random point in the camera defocus disk.
-            auto p = random_in_unit_disk();
+            auto p = random_in_unit_disk(s);
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        color ray_color(const ray& r, int depth, const hittable& world) const {
-            // If we've exceeded the ray bounce limit, no more light is gathered.
-            // Using a pink color to accentuate where we are running out of bounces.
-            if (depth <= 0) return color(1,0,1);
-            
-            hit_record rec;
+        color ray_color(const ray& r, const hittable& world, sampler& s, path_stats& stats) const {
+            // Follows one path iteratively, carrying the product of the attenuations so far.
+            // After russian_roulette_depth bounces, a path survives each bounce with probability
+            // equal to its brightest throughput channel and is reweighted by the inverse, so
+            // low-energy paths end early without biasing the image. max_depth remains a hard cap.
+            //
+            // At every diffuse bounce a light is also sampled directly. Its contribution and the
+            // emission later found by the scattered ray are combined with the power heuristic.
+            color radiance(0, 0, 0);
+            color throughput(1, 1, 1);
+            ray current = r;
+            int depth = 0;
+            double scatter_pdf = 0;   // Density of the last diffuse bounce, 0 after a specular one
+
+            while (true) {
+                if (depth >= max_depth) {
+                    stats.depth_limit++;
+                    break;
+                }
+
+                hit_record rec;
+
+                if (!world.closest_hit(current, interval(0.001, infinity), rec)) {
+                    radiance += throughput * background;
+                    stats.escaped++;
+                    break;
+                }
+
+                color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+                if (scatter_pdf > 0) {
+                    auto light = light_pdf(rec.object, current.origin(), current.direction());
+                    color_from_emission = color_from_emission * power_heuristic(scatter_pdf, light);
+                }
+                radiance += throughput * color_from_emission;
+
+                ray scattered;
+                color attenuation;
+
+                if (!rec.mat->scatter(current, rec, attenuation, scattered, s)) {
+                    stats.absorbed++;
+                    break;
+                }
+
+                scatter_pdf = rec.mat->scattering_pdf(current, rec, scattered);
+                if (scatter_pdf > 0 && !lights.empty())
+                    radiance += throughput * attenuation * sample_light(current, rec, world, s);
+
+                throughput = throughput * attenuation;
+                depth++;
+
+                if (depth >= russian_roulette_depth) {
+                    auto survival = std::fmin(1.0, std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())));
+                    if (s.get_1d() >= survival) {
+                        stats.roulette++;
+                        break;
+                    }
+                    throughput /= survival;
+                }
+
+                current = scattered;
+            }
+
+            stats.lengths[depth]++;
+            return radiance;
+        }
+
+        color sample_light(const ray& r_in, const hit_record& rec, const hittable& world, sampler& s) const {
+            // One light-sampling estimate of the light reaching rec, divided by the attenuation
+            // that scatter returned there.
+            auto index = std::min(static_cast<size_t>(s.get_1d() * lights.size()), lights.size() - 1);
+            const hittable* light = lights[index];
+
+            auto to_light = light->random(rec.p, s);
+            auto distance = to_light.length();
+            if (distance <= 0.001) return color(0, 0, 0);
 
-            if (!world.hit(r, interval(0.001, infinity), rec)) return background;
+            ray shadow(rec.p, to_light / distance, r_in.time());
+            auto scatter_pdf = rec.mat->scattering_pdf(r_in, rec, shadow);
+            if (scatter_pdf <= 0) return color(0, 0, 0);
 
-            ray scattered;
-            color attenuation;
-            color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+            hit_record light_rec;
+            if (!light->closest_hit(shadow, interval(0.001, infinity), light_rec)) return color(0, 0, 0);
 
-            if (!rec.mat->scatter(r, rec, attenuation, scattered))
-                return color_from_emission;
+            if (world.occluded(shadow, interval(0.001, light_rec.t - 0.001))) return color(0, 0, 0);
 
-            double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
-            double pdf = scattering_pdf;
-            // double pdf = 1 / (2*pi);
+            auto pdf = light_pdf(light, rec.p, shadow.direction());
+            if (pdf <= 0) return color(0, 0, 0);
 
-            // color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world);
-            color color_from_scatter = (attenuation * scattering_pdf * ray_color(scattered, depth-1, world)) / pdf;
+            auto emitted = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+            return emitted * scatter_pdf * power_heuristic(pdf, scatter_pdf) / pdf;
+        }
+
+        double light_pdf(const hittable* object, const point3& origin, const vec3& direction) const {
+            // The density with which light sampling picks direction and lands on object: zero
+            // unless object is one of the sampled lights.
+            if (object == nullptr || std::find(lights.begin(), lights.end(), object) == lights.end())
+                return 0;
+
+            return object->pdf_value(origin, direction) / lights.size();
+        }
 
-            return color_from_emission + color_from_scatter;
+        static double power_heuristic(double pdf, double other_pdf) {
+            auto a = pdf * pdf;
+            auto b = other_pdf * other_pdf;
+            return (a + b > 0) ? a / (a + b) : 0;
         }
 };
 
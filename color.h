@@ -7,11 +7,16 @@
 
 using color = vec3;
 
+inline double luminance(const color& c) {
+    // Rec. 709 relative luminance of a linear color.
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 inline double linear_to_gamma(double linear_component) {
     return sqrt(linear_component);
 }
 
-color adjust_color(color pixel_color, int samples_per_pixel) {
+color adjust_color(color pixel_color, int samples_per_pixel = 1) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -29,12 +34,17 @@ color adjust_color(color pixel_color, int samples_per_pixel) {
     return color(r, g, b);
 }
 
+inline unsigned char color_byte(double component) {
+    // Translate a gamma-corrected component to its [0,255] value.
+    static const interval intensity(0.000, 0.999);
+    return static_cast<unsigned char>(256 * intensity.clamp(component));
+}
+
 void output_color(std::ostream &out, color pixel_color) {
     // Write the translated [0,255] value of each color component.
-    static const interval intensity(0.000, 0.999);
-    out << static_cast<int>(256 * intensity.clamp(pixel_color.x())) << ' '
-        << static_cast<int>(256 * intensity.clamp(pixel_color.y())) << ' '
-        << static_cast<int>(256 * intensity.clamp(pixel_color.z())) << '\n';
+    out << static_cast<int>(color_byte(pixel_color.x())) << ' '
+        << static_cast<int>(color_byte(pixel_color.y())) << ' '
+        << static_cast<int>(color_byte(pixel_color.z())) << '\n';
 }
 
 void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
@@ -0,0 +1,181 @@
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+#include "rtweekend.h"
+#include "wide_bvh.h"
+
+#include <cstdint>
+#include <cstring>
+
+struct alignas(64) compressed_node {
+    // A 4-wide node in one cache line. The children's boxes are stored as 8-bit steps from the
+    // node's lower corner, with a power-of-two step per axis, rounded outwards so a quantized
+    // box always contains the child. Dequantizing takes one exact multiply and one add, and
+    // the node is built with the same float arithmetic, so the rounding is accounted for.
+    static constexpr int width = 4;
+
+    float origin[3];        // The node's lower corner
+    int8_t exponent[3];     // Children's boxes are in steps of 2^exponent from origin
+    uint8_t lanes;          // Children in use
+    uint8_t lower[3][4];    // [axis][child]
+    uint8_t upper[3][4];
+    uint32_t child[4];      // An interior child's node, or a leaf child's first primitive
+    uint8_t count[4];       // Primitives in a leaf child, 0 for an interior child
+
+    void set_bounds(const bvh_node::linear_node* const* children, int n) {
+        lanes = static_cast<uint8_t>(n);
+
+        for (int a = 0; a < 3; a++) {
+            auto lo = std::numeric_limits<float>::infinity();
+            auto hi = -std::numeric_limits<float>::infinity();
+            for (int i = 0; i < n; i++) {
+                lo = std::fmin(lo, children[i]->lower[a]);
+                hi = std::fmax(hi, children[i]->upper[a]);
+            }
+
+            origin[a] = lo;
+
+            // The smallest step for which 255 steps reach the upper corner.
+            auto extent = static_cast<double>(hi) - lo;
+            int e = extent > 0 ? static_cast<int>(std::ceil(std::log2(extent / 255))) : min_exponent;
+            e = std::max(e, min_exponent);
+            while (e < max_exponent && dequantize(a, 255, e) < hi) e++;
+            exponent[a] = static_cast<int8_t>(e);
+
+            for (int i = 0; i < 4; i++) {
+                if (i >= n) {
+                    lower[a][i] = 255;
+                    upper[a][i] = 0;
+                    continue;
+                }
+
+                auto step = std::ldexp(1.0, e);
+                auto ql = static_cast<int>(std::floor((children[i]->lower[a] - static_cast<double>(lo)) / step));
+                auto qu = static_cast<int>(std::ceil((children[i]->upper[a] - static_cast<double>(lo)) / step));
+                ql = std::clamp(ql, 0, 255);
+                qu = std::clamp(qu, 0, 255);
+
+                while (ql > 0 && dequantize(a, ql, e) > children[i]->lower[a]) ql--;
+                while (qu < 255 && dequantize(a, qu, e) < children[i]->upper[a]) qu++;
+
+                lower[a][i] = static_cast<uint8_t>(ql);
+                upper[a][i] = static_cast<uint8_t>(qu);
+            }
+        }
+    }
+
+    float step(int a) const { return exponent_scale(exponent[a]); }
+
+    float dequantize(int a, int q, int e) const {
+        return origin[a] + static_cast<float>(q) * exponent_scale(e);
+    }
+
+    static constexpr int min_exponent = -126;
+    static constexpr int max_exponent = 127;
+
+    static float exponent_scale(int e) {
+        // 2^e, built from the float's exponent bits.
+        uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return scale;
+    }
+};
+
+static_assert(sizeof(compressed_node) == 64, "compressed nodes should fill one cache line");
+
+inline int slab_test(const compressed_node& node, const wide_ray& r, float tmin, float tmax, float* tnear) {
+    auto in_use = (1 << node.lanes) - 1;
+
+#if defined(RT_BVH_SSE)
+    auto load_steps = [](const uint8_t* q) {
+        int32_t bits;
+        std::memcpy(&bits, q, sizeof(bits));
+        auto zero = _mm_setzero_si128();
+        auto v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero), zero);
+        return _mm_cvtepi32_ps(v);
+    };
+
+    auto t0 = _mm_set1_ps(tmin);
+    auto t1 = _mm_set1_ps(tmax);
+    auto robust = _mm_set1_ps(wide_slab_robust);
+
+    for (int a = 0; a < 3; a++) {
+        auto corner = _mm_set1_ps(node.origin[a]);
+        auto step = _mm_set1_ps(node.step(a));
+        auto lo = _mm_add_ps(corner, _mm_mul_ps(load_steps(node.lower[a]), step));
+        auto hi = _mm_add_ps(corner, _mm_mul_ps(load_steps(node.upper[a]), step));
+
+        auto origin = _mm_set1_ps(r.origin[a]);
+        auto inv = _mm_set1_ps(r.inv_direction[a]);
+        auto slack = _mm_set1_ps(r.slack[a]);
+        auto n = _mm_mul_ps(_mm_sub_ps(r.near_side[a] ? hi : lo, origin), inv);
+        auto f = _mm_mul_ps(_mm_sub_ps(r.near_side[a] ? lo : hi, origin), inv);
+
+        t0 = _mm_max_ps(_mm_sub_ps(n, slack), t0);
+        t1 = _mm_min_ps(_mm_add_ps(_mm_mul_ps(f, robust), slack), t1);
+    }
+
+    _mm_storeu_ps(tnear, t0);
+    return _mm_movemask_ps(_mm_cmplt_ps(t0, t1)) & in_use;
+#elif defined(RT_BVH_NEON)
+    auto load_steps = [](const uint8_t* q) {
+        uint32_t bits;
+        std::memcpy(&bits, q, sizeof(bits));
+        auto wide = vmovl_u16(vget_low_u16(vmovl_u8(vcreate_u8(bits))));
+        return vcvtq_f32_u32(wide);
+    };
+
+    auto t0 = vdupq_n_f32(tmin);
+    auto t1 = vdupq_n_f32(tmax);
+    auto robust = vdupq_n_f32(wide_slab_robust);
+
+    for (int a = 0; a < 3; a++) {
+        auto corner = vdupq_n_f32(node.origin[a]);
+        auto step = vdupq_n_f32(node.step(a));
+        auto lo = vaddq_f32(corner, vmulq_f32(load_steps(node.lower[a]), step));
+        auto hi = vaddq_f32(corner, vmulq_f32(load_steps(node.upper[a]), step));
+
+        auto origin = vdupq_n_f32(r.origin[a]);
+        auto inv = vdupq_n_f32(r.inv_direction[a]);
+        auto slack = vdupq_n_f32(r.slack[a]);
+        auto n = vmulq_f32(vsubq_f32(r.near_side[a] ? hi : lo, origin), inv);
+        auto f = vmulq_f32(vsubq_f32(r.near_side[a] ? lo : hi, origin), inv);
+
+        t0 = vmaxnmq_f32(vsubq_f32(n, slack), t0);
+        t1 = vminnmq_f32(vaddq_f32(vmulq_f32(f, robust), slack), t1);
+    }
+
+    vst1q_f32(tnear, t0);
+    static const uint32_t bits[4] = { 1, 2, 4, 8 };
+    return static_cast<int>(vaddvq_u32(vandq_u32(vcltq_f32(t0, t1), vld1q_u32(bits)))) & in_use;
+#else
+    int mask = 0;
+
+    for (int i = 0; i < 4; i++) {
+        auto t0 = tmin, t1 = tmax;
+
+        for (int a = 0; a < 3; a++) {
+            auto lo = node.origin[a] + static_cast<float>(node.lower[a][i]) * node.step(a);
+            auto hi = node.origin[a] + static_cast<float>(node.upper[a][i]) * node.step(a);
+            auto n = ((r.near_side[a] ? hi : lo) - r.origin[a]) * r.inv_direction[a];
+            auto f = ((r.near_side[a] ? lo : hi) - r.origin[a]) * r.inv_direction[a];
+
+            n -= r.slack[a];
+            f = f * wide_slab_robust + r.slack[a];
+
+            if (n > t0) t0 = n;
+            if (f < t1) t1 = f;
+        }
+
+        tnear[i] = t0;
+        if (t0 < t1) mask |= 1 << i;
+    }
+
+    return mask & in_use;
+#endif
+}
+
+using compressed_bvh = basic_wide_bvh<compressed_node>;
+
+#endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "material.h"
+#include "sampler.h"
 #include "texture.h"
 
 class constant_medium : public hittable {
@@ -21,52 +22,72 @@ class constant_medium : public hittable {
             {}
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            const bool enableDebug = false;
-            const bool debugging = enableDebug && random_double() < 0.00001;
+            double t;
+            if (!sample_hit(r, ray_t, t)) return false;
+
+            rec.t = t;
+            rec.object = this;
+            return true;
+        }
+
+        void finalize_hit(const ray& r, hit_record& rec) const override {
+            rec.p = r.at(rec.t);
+
+            rec.normal = vec3(1,0,0); // arbitrary
+            rec.front_face = true; // also arbitrary
+            rec.mat = phase_function.get();
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            // The same free-flight sample as hit, so both queries agree for a given ray.
+            double t;
+            return sample_hit(r, ray_t, t);
+        }
+
+        aabb bounding_box() const override { return boundary->bounding_box(); }
+    
+    private:
+        shared_ptr<hittable> boundary;
+        double neg_inv_density;
+        shared_ptr<material> phase_function;
+
+        bool sample_hit(const ray& r, interval ray_t, double& t) const {
+            // Free-flight distances come from a stream keyed on the ray, so a medium is sampled
+            // the same way no matter which thread traces it.
+            independent_sampler s(r);
 
-            hit_record rec1, rec2;
+            const bool enableDebug = false;
+            const bool debugging = enableDebug && s.random_double() < 0.00001;
 
-            if (!boundary->hit(r, interval::universe, rec1)) return false;
-            if (!boundary->hit(r, interval(rec1.t + 0.0001, infinity), rec2)) return false;
+            interval inside;
+            if (!boundary->entry_exit(r, inside)) return false;
 
-            if (debugging) std::clog << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
+            if (debugging) std::clog << "\nt_min=" << inside.min << ", t_max=" << inside.max << '\n';
 
-            if (rec1.t < ray_t.min) rec1.t = ray_t.min;
-            if (rec2.t > ray_t.max) rec2.t = ray_t.max;
+            if (inside.min < ray_t.min) inside.min = ray_t.min;
+            if (inside.max > ray_t.max) inside.max = ray_t.max;
 
-            if (rec1.t >= rec2.t) return false;
+            if (inside.min >= inside.max) return false;
 
-            if (rec1.t < 0) rec1.t = 0;
+            if (inside.min < 0) inside.min = 0;
 
             auto ray_length = r.direction().length();
-            auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-            auto hit_distance = neg_inv_density * log(random_double());
+            auto distance_inside_boundary = (inside.max - inside.min) * ray_length;
+            auto hit_distance = neg_inv_density * log(1 - s.random_double());
 
             if (hit_distance > distance_inside_boundary) return false;
 
-            rec.t = rec1.t + hit_distance / ray_length;
-            rec.p = r.at(rec.t);
+            t = inside.min + hit_distance / ray_length;
 
             if (debugging) {
                 std::clog << "hit_distance = " << hit_distance << '\n'
                           << "distance_inside_boundary = " << distance_inside_boundary << '\n'
-                          << "rec.t = " << rec.t << '\n'
-                          << "rec.p = " << rec.p << '\n';
+                          << "t = " << t << '\n'
+                          << "p = " << r.at(t) << '\n';
             }
 
-            rec.normal = vec3(1,0,0); // arbitrary
-            rec.front_face = true; // also arbitrary
-            rec.mat = phase_function;
-
             return true;
         }
-        
-        aabb bounding_box() const override { return boundary->bounding_box(); }
-    
-    private:
-        shared_ptr<hittable> boundary;
-        double neg_inv_density;
-        shared_ptr<material> phase_function;
 };
 
 #endif
\ No newline at end of file
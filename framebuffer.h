@@ -0,0 +1,297 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// Accumulation precision: float by default, double with RT_FRAMEBUFFER_DOUBLE.
+#if defined(RT_FRAMEBUFFER_DOUBLE)
+using fb_real = double;
+#else
+using fb_real = float;
+#endif
+
+class half {
+    public:
+        // IEEE 754 binary16, used only as a compact storage format.
+        half() : bits(0) {}
+        half(float f) : bits(from_float(f)) {}
+
+        operator float() const { return to_float(bits); }
+
+    private:
+        uint16_t bits;
+
+        static uint16_t from_float(float f) {
+            uint32_t x;
+            std::memcpy(&x, &f, sizeof(x));
+
+            uint32_t sign = (x >> 16) & 0x8000;
+            int exponent = static_cast<int>((x >> 23) & 0xff) - 127 + 15;
+            uint32_t mantissa = x & 0x7fffff;
+
+            if (((x >> 23) & 0xff) == 0xff)                 // Inf or NaN
+                return static_cast<uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+            if (exponent >= 31)                             // Overflow to Inf
+                return static_cast<uint16_t>(sign | 0x7c00);
+            if (exponent <= 0) {                            // Subnormal or zero
+                if (exponent < -10) return static_cast<uint16_t>(sign);
+                mantissa |= 0x800000;
+                auto shift = static_cast<uint32_t>(14 - exponent);
+                auto rounded = (mantissa + (1u << (shift - 1))) >> shift;
+                return static_cast<uint16_t>(sign | rounded);
+            }
+
+            // Round to nearest; a carry out of the mantissa correctly bumps the exponent.
+            auto rounded = (static_cast<uint32_t>(exponent) << 10 | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+            return static_cast<uint16_t>(sign | rounded);
+        }
+
+        static float to_float(uint16_t h) {
+            uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+            uint32_t exponent = (h >> 10) & 0x1f;
+            uint32_t mantissa = h & 0x3ff;
+            uint32_t x;
+
+            if (exponent == 0x1f) {
+                x = sign | 0x7f800000 | (mantissa << 13);
+            } else if (exponent != 0) {
+                x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+            } else if (mantissa == 0) {
+                x = sign;
+            } else {
+                // Renormalize a subnormal half.
+                exponent = 127 - 15 + 1;
+                while (!(mantissa & 0x400)) {
+                    mantissa <<= 1;
+                    exponent--;
+                }
+                x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+            }
+
+            float f;
+            std::memcpy(&f, &x, sizeof(f));
+            return f;
+        }
+};
+
+// Storage for finished pixels: fb_real, or fp16 with RT_FRAMEBUFFER_HALF. Samples are always
+// summed in fb_real before they are folded into a pixel.
+#if defined(RT_FRAMEBUFFER_HALF)
+using fb_channel = half;
+#else
+using fb_channel = fb_real;
+#endif
+
+struct fb_pixel {
+    fb_channel r, g, b;
+};
+
+// A pixel's running mean while it is still taking samples.
+struct fb_mean {
+    fb_real r, g, b;
+};
+
+class framebuffer {
+    public:
+        // Rows are padded to a whole number of blocks of pixels_per_block() pixels, so each row
+        // starts on a cache line and a block fills whole lines in every plane. A block is 16
+        // pixels with float or double pixels, so 16-pixel tiles never share a line. fp16 pixels
+        // are 6 bytes and need 32-pixel blocks; tile views then keep their means in fb_real and
+        // write each pixel once, in finish(), so neighbouring tiles share lines only then.
+        static constexpr size_t cache_line = 64;
+
+        class tile_view {
+            public:
+                tile_view(framebuffer& _fb, int _x0, int _y0, int _x1, int _y1)
+                 : fb(_fb), x0(_x0), y0(_y0), x1(_x1), y1(_y1)
+#if defined(RT_FRAMEBUFFER_HALF)
+                 , means(static_cast<size_t>(width()) * height())
+#endif
+                {
+#if defined(RT_FRAMEBUFFER_HALF)
+                    for (int j = 0; j < height(); j++) {
+                        for (int i = 0; i < width(); i++) {
+                            const auto& p = fb.pixels[fb.index(x0 + i, y0 + j)];
+                            means[j * width() + i] = fb_mean{ p.r, p.g, p.b };
+                        }
+                    }
+#endif
+                }
+
+                int width() const { return x1 - x0; }
+                int height() const { return y1 - y0; }
+
+                // Coordinates are relative to the tile's top-left corner.
+                void add_samples(int i, int j, const color& sum, int n, double m2 = 0) {
+                    fb.fold(fb.index(x0 + i, y0 + j), mean(i, j), sum, n, m2);
+                }
+
+                color value(int i, int j) const {
+#if defined(RT_FRAMEBUFFER_HALF)
+                    const auto& p = means[j * width() + i];
+                    return color(p.r, p.g, p.b);
+#else
+                    return fb.value(x0 + i, y0 + j);
+#endif
+                }
+
+                int samples(int i, int j) const { return fb.samples(x0 + i, y0 + j); }
+
+                double relative_error(int i, int j) const {
+                    return framebuffer::relative_error(value(i, j), samples(i, j), fb.variance(x0 + i, y0 + j));
+                }
+
+                // Stores the tile's pixels in the framebuffer. Call it before reading them back.
+                void finish() {
+#if defined(RT_FRAMEBUFFER_HALF)
+                    for (int j = 0; j < height(); j++) {
+                        for (int i = 0; i < width(); i++) {
+                            const auto& m = means[j * width() + i];
+                            auto& p = fb.pixels[fb.index(x0 + i, y0 + j)];
+                            p.r = m.r;
+                            p.g = m.g;
+                            p.b = m.b;
+                        }
+                    }
+#endif
+                }
+
+            private:
+                framebuffer& fb;
+                int x0, y0, x1, y1;
+#if defined(RT_FRAMEBUFFER_HALF)
+                std::vector<fb_mean> means;
+
+                fb_mean& mean(int i, int j) { return means[j * width() + i]; }
+#else
+                fb_pixel& mean(int i, int j) { return fb.pixels[fb.index(x0 + i, y0 + j)]; }
+#endif
+        };
+
+        framebuffer(int _width, int _height) : image_width(_width), image_height(_height) {
+            row_stride = round_up(static_cast<size_t>(image_width), pixels_per_block());
+
+            auto count = row_stride * image_height;
+            pixels = static_cast<fb_pixel*>(allocate(count * sizeof(fb_pixel)));
+            counts = static_cast<uint32_t*>(allocate(count * sizeof(uint32_t)));
+            m2s = static_cast<fb_real*>(allocate(count * sizeof(fb_real)));
+
+            for (size_t i = 0; i < count; i++) {
+                pixels[i] = fb_pixel{ 0, 0, 0 };
+                counts[i] = 0;
+                m2s[i] = 0;
+            }
+        }
+
+        ~framebuffer() {
+            release(pixels);
+            release(counts);
+            release(m2s);
+        }
+
+        framebuffer(const framebuffer&) = delete;
+        framebuffer& operator=(const framebuffer&) = delete;
+
+        int width() const { return image_width; }
+        int height() const { return image_height; }
+        size_t stride() const { return row_stride; }
+
+        const fb_pixel* row(int y) const { return pixels + y * row_stride; }
+
+        tile_view tile(int x0, int y0, int x1, int y1) { return tile_view(*this, x0, y0, x1, y1); }
+
+        void add_samples(int x, int y, const color& sum, int n, double m2 = 0) {
+            // Folds a batch of n samples into pixel (x,y). With fp16 pixels each call rounds the
+            // mean again, so pixels that take several batches should go through a tile_view.
+            auto index = this->index(x, y);
+            auto& p = pixels[index];
+            fb_mean mean{ p.r, p.g, p.b };
+            fold(index, mean, sum, n, m2);
+            p.r = mean.r;
+            p.g = mean.g;
+            p.b = mean.b;
+        }
+
+        color value(int x, int y) const {
+            // The mean linear radiance of the pixel.
+            const auto& p = pixels[index(x, y)];
+            return color(static_cast<fb_real>(p.r), static_cast<fb_real>(p.g), static_cast<fb_real>(p.b));
+        }
+
+        int samples(int x, int y) const { return static_cast<int>(counts[index(x, y)]); }
+
+        double variance(int x, int y) const {
+            // The sample variance of the pixel's luminance.
+            auto index = this->index(x, y);
+            return (counts[index] < 2) ? 0 : m2s[index] / (counts[index] - 1);
+        }
+
+        double relative_error(int x, int y) const {
+            return relative_error(value(x, y), samples(x, y), variance(x, y));
+        }
+
+    private:
+        int image_width;
+        int image_height;
+        size_t row_stride;
+        fb_pixel* pixels;
+        uint32_t* counts;
+        fb_real* m2s;
+
+        size_t index(int x, int y) const { return y * row_stride + x; }
+
+        template <typename pixel>
+        void fold(size_t index, pixel& mean, const color& sum, int n, double m2) {
+            // Folds a batch of n samples, whose radiance adds up to sum, into the pixel's running
+            // mean. m2 is the batch's sum of squared luminance deviations (Welford's M2); the
+            // batches are merged with Chan's update so the pixel's variance stays exact.
+            auto old_n = static_cast<fb_real>(counts[index]);
+            auto total = old_n + n;
+
+            auto delta = luminance(sum) / n - luminance(color(mean.r, mean.g, mean.b));
+            m2s[index] = static_cast<fb_real>(m2s[index] + m2 + delta * delta * old_n * n / total);
+
+            mean.r = static_cast<fb_real>((old_n * mean.r + static_cast<fb_real>(sum.x())) / total);
+            mean.g = static_cast<fb_real>((old_n * mean.g + static_cast<fb_real>(sum.y())) / total);
+            mean.b = static_cast<fb_real>((old_n * mean.b + static_cast<fb_real>(sum.z())) / total);
+            counts[index] += n;
+        }
+
+        static double relative_error(const color& mean, int n, double variance) {
+            // The standard error of the pixel's mean luminance, relative to that mean. The small
+            // floor keeps black pixels from needing an exact zero to converge.
+            if (n == 0) return infinity;
+            return sqrt(variance / n) / (luminance(mean) + 0.001);
+        }
+
+        static size_t pixels_per_block() {
+            // The smallest pixel count that fills a whole number of cache lines in every plane.
+            size_t n = 1;
+            while ((n * sizeof(fb_pixel)) % cache_line != 0
+                   || (n * sizeof(uint32_t)) % cache_line != 0
+                   || (n * sizeof(fb_real)) % cache_line != 0)
+                n++;
+            return n;
+        }
+
+        static size_t round_up(size_t n, size_t multiple) {
+            return (n + multiple - 1) / multiple * multiple;
+        }
+
+        static void* allocate(size_t bytes) {
+            return ::operator new(bytes, std::align_val_t(cache_line));
+        }
+
+        static void release(void* p) {
+            ::operator delete(p, std::align_val_t(cache_line));
+        }
+};
+
+#endif
\ No newline at end of file
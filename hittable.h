@@ -3,18 +3,29 @@
 
 #include "rtweekend.h"
 #include "aabb.h"
+#include "affine.h"
+#include "sampler.h"
+
+#include <cstdint>
+#include <type_traits>
+#include <vector>
 
 class material;
+class hittable;
 
 class hit_record {
     public:
+        // hit sets t, object and primitive, and whatever the object keeps in u and v to finish
+        // the hit later; the rest waits for object->finalize_hit, once the closest hit is known.
         point3 p;
         vec3 normal;
-        shared_ptr<material> mat;
+        const material* mat = nullptr;      // Owned by the object that was hit
         double t;
         double u;
         double v;
         bool front_face;
+        const hittable* object = nullptr;   // The primitive that was hit
+        uint32_t primitive = 0;             // Which of object's parts, for objects with many
 
         void set_face_normal(const ray& r, const vec3& outward_normal) {
             front_face = dot(r.direction(), outward_normal) < 0;
@@ -22,108 +33,144 @@ class hit_record {
         }
 };
 
+// Records are copied for every closer hit; holding no reference counts keeps that a plain copy,
+// with no atomic traffic on the counters of materials every thread hits.
+static_assert(std::is_trivially_copyable<hit_record>::value, "hit_record should copy as plain data");
+
 class hittable {
     public:
         virtual ~hittable() = default;
 
         virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
         virtual aabb bounding_box() const = 0;
-};
 
-class translate : public hittable {
-    public:
-        translate(shared_ptr<hittable> p, const vec3& displacement)
-         : object(p), offset(displacement) {
-            bbox = object->bounding_box() + offset;
-        }
+        // Fills in the attributes of a hit that this object's hit found along r: the point,
+        // normals, material and texture coordinates. Traversal discards most hits for closer
+        // ones, so this work is left until a hit is known to be the closest.
+        virtual void finalize_hit(const ray& r, hit_record& rec) const {}
 
-        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            ray offset_r(r.origin() - offset, r.direction(), r.time());
+        // hit, with the closest hit's attributes filled in.
+        bool closest_hit(const ray& r, interval ray_t, hit_record& rec) const {
+            if (!hit(r, ray_t, rec)) return false;
+            rec.object->finalize_hit(r, rec);
+            return true;
+        }
 
-            if (!object->hit(offset_r, ray_t, rec)) return false;
+        // Any-hit query for visibility: true if anything is hit within ray_t. Overrides stop
+        // at the first hit and skip the attributes a hit_record would need.
+        virtual bool occluded(const ray& r, interval ray_t) const {
+            hit_record rec;
+            return hit(r, ray_t, rec);
+        }
 
-            rec.p += offset;
+        // Where r enters this closed object and where it next leaves it, for volumes bounded
+        // by the object. The entry may be behind the ray's origin. The default finds both with
+        // hit; shapes that get them from one test override it.
+        virtual bool entry_exit(const ray& r, interval& span) const {
+            hit_record entry, exit;
+            if (!hit(r, interval::universe, entry)) return false;
+            if (!hit(r, interval(entry.t + 0.0001, infinity), exit)) return false;
 
+            span = interval(entry.t, exit.t);
             return true;
         }
 
-        aabb bounding_box() const override { return bbox; }
+        // Light sampling. pdf_value is the solid-angle density, seen from origin, with which
+        // random picks direction; random returns a vector from origin to a point on the object.
+        virtual double pdf_value(const point3& origin, const vec3& direction) const {
+            return 0.0;
+        }
 
-    private:
-        shared_ptr<hittable> object;
-        vec3 offset;
-        aabb bbox;
+        virtual vec3 random(const point3& origin, sampler& s) const {
+            return vec3(1, 0, 0);
+        }
+
+        // Bounds at the start (time 0) and end (time 1) of the shutter, for objects that move
+        // linearly: the box at any time in between is then the interpolation of the two. The
+        // default, the whole box at both ends, suits everything else.
+        virtual void motion_bounds(aabb& start, aabb& end) const {
+            start = end = bounding_box();
+        }
+
+        // The bounds of the part of this object inside region, for BVH builders that split an
+        // object's box between nodes. The default, the whole box, keeps the object in one
+        // piece: composites such as instances and nested BVHs must not be split, since a ray
+        // reaching any piece would walk all of them. Simple shapes override it.
+        virtual aabb clip_box(const aabb& region) const {
+            return bounding_box();
+        }
+
+        // Adds the emitters among this object and its parts that can be sampled directly.
+        virtual void collect_lights(std::vector<const hittable*>& lights) const {}
 };
 
-class rotate_y : public hittable {
+class instance : public hittable {
     public:
-        rotate_y(shared_ptr<hittable> p, double angle) : object(p) {
-            auto radians = degrees_to_radians(angle);
-            sin_theta = sin(radians);
-            cos_theta = cos(radians);
-            bbox = object->bounding_box();
-
-            point3 min(infinity, infinity, infinity);
-            point3 max(-infinity, -infinity, -infinity);
-
-            for (int i = 0; i < 2; i++) {
-                for (int j = 0; j < 2; j++) {
-                    for (int k = 0; k < 2; k++) {
-                        auto x = i * bbox.x.max + (1 - i) * bbox.x.min;
-                        auto y = j * bbox.y.max + (1 - j) * bbox.y.min;
-                        auto z = k * bbox.z.max + (1 - k) * bbox.z.min;
-
-                        auto newx = cos_theta * x + sin_theta * z;
-                        auto newz = -sin_theta * x + cos_theta * z;
-
-                        vec3 tester(newx, y, newz);
-
-                        for (int c = 0; c < 3; c++) {
-                            min[c] = fmin(min[c], tester[c]);
-                            max[c] = fmax(max[c], tester[c]);
-                        }
-                    }
-                }
+        // An object placed in the scene by an affine transform. Instances can share one object
+        // (a group of primitives behind its own BVH, say), so an asset's geometry is in memory
+        // once however many copies there are, and a BVH over the instances forms the top level.
+        // An instance of an instance is folded into one instance with the combined transform,
+        // so nesting translate and rotate_y still costs one matrix per ray.
+        instance(shared_ptr<hittable> p, const affine& transform) {
+            if (auto inner = std::dynamic_pointer_cast<instance>(p)) {
+                object = inner->object;
+                to_world = transform * inner->to_world;
+            } else {
+                object = p;
+                to_world = transform;
             }
 
-            bbox = aabb(min, max);
+            to_object = to_world.inverse();
+            bbox = to_world.box(object->bounding_box());
         }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            auto origin = r.origin();
-            auto direction = r.direction();
-
-            origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-            origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
-
-            direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-            direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-
-            ray rotated_r(origin, direction, r.time());
-
-            if (!object->hit(rotated_r, ray_t, rec)) return false;
+            // The direction is transformed but not normalized, so t is the same in both spaces.
+            // The hit is finished here, in the object's space, and comes out as the instance's
+            // own: instances share their object, so the record could not say which one to
+            // transform it by later.
+            auto local = object_ray(r);
+            if (!object->hit(local, ray_t, rec)) return false;
+
+            rec.object->finalize_hit(local, rec);
+            rec.p = to_world.point(rec.p);
+            rec.normal = unit_vector(to_object.normal(rec.normal));
+            rec.object = this;
 
-            auto p = rec.p;
-            p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
-            p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
-
-            auto normal = rec.normal;
-            normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
-            normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
+            return true;
+        }
 
-            rec.p = p;
-            rec.normal = normal;
+        bool occluded(const ray& r, interval ray_t) const override {
+            return object->occluded(object_ray(r), ray_t);
+        }
 
-            return true;
+        bool entry_exit(const ray& r, interval& span) const override {
+            return object->entry_exit(object_ray(r), span);
         }
 
         aabb bounding_box() const override { return bbox; }
-    
+
     private:
         shared_ptr<hittable> object;
-        double sin_theta;
-        double cos_theta;
+        affine to_world;
+        affine to_object;
         aabb bbox;
+
+        ray object_ray(const ray& r) const {
+            return ray(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+        }
+};
+
+class translate : public instance {
+    public:
+        translate(shared_ptr<hittable> p, const vec3& displacement)
+         : instance(p, affine::translation(displacement)) {}
+};
+
+class rotate_y : public instance {
+    public:
+        rotate_y(shared_ptr<hittable> p, double angle)
+         : instance(p, affine::rotation_y(angle)) {}
 };
 
 #endif
\ No newline at end of file
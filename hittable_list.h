@@ -4,6 +4,7 @@
 #include "aabb.h"
 #include "hittable.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -37,7 +38,37 @@ class hittable_list : public hittable {
             return hit_anything;
         }
 
+        bool occluded(const ray& r, interval ray_t) const override {
+            for (const auto& object : objects)
+                if (object->occluded(r, ray_t)) return true;
+
+            return false;
+        }
+
         aabb bounding_box() const override { return bbox; }
+
+        double pdf_value(const point3& origin, const vec3& direction) const override {
+            // The density of picking one of the objects uniformly and then sampling it.
+            if (objects.empty()) return 0.0;
+
+            auto weight = 1.0 / objects.size();
+            auto sum = 0.0;
+
+            for (const auto& object : objects)
+                sum += weight * object->pdf_value(origin, direction);
+
+            return sum;
+        }
+
+        vec3 random(const point3& origin, sampler& s) const override {
+            auto int_size = static_cast<int>(objects.size());
+            auto index = std::min(static_cast<int>(s.get_1d() * int_size), int_size - 1);
+            return objects[index]->random(origin, s);
+        }
+
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            for (const auto& object : objects) object->collect_lights(lights);
+        }
     
     private:
         aabb bbox;
@@ -9,8 +9,10 @@ class interval {
 
         interval(double _min, double _max) : min(_min), max(_max) {}
 
+        // Plain comparisons rather than fmin and fmax, which are library calls: the builders
+        // merge boxes in their innermost loops, and bounds are never NaN.
         interval(const interval& a, const interval& b)
-         : min(fmin(a.min, b.min)), max(fmax(a.max, b.max)) {}
+         : min(a.min < b.min ? a.min : b.min), max(a.max > b.max ? a.max : b.max) {}
 
         bool contains(double x) const {
             return min <= x && x <= max;
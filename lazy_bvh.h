@@ -0,0 +1,167 @@
+#ifndef LAZY_BVH_H
+#define LAZY_BVH_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+class deferred_bvh : public hittable {
+    public:
+        // A group of objects whose BVH is built the first time a ray enters the group's box.
+        // Threads that arrive before the tree exists each build one and race to publish it with
+        // a compare-and-swap; the losers delete theirs and use the winner's, so no thread ever
+        // waits on another.
+        deferred_bvh(std::vector<shared_ptr<hittable>> group, const aabb& box)
+         : objects(std::move(group)), bbox(box) {}
+
+        ~deferred_bvh() {
+            delete tree.load(std::memory_order_acquire);
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            return subtree().hit(r, ray_t, rec);
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            return subtree().occluded(r, ray_t);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            // From the objects directly: the camera collects lights before the first ray, and
+            // that should not build anything.
+            collect_unique_lights(objects, lights);
+        }
+
+        bool is_built() const { return tree.load(std::memory_order_acquire) != nullptr; }
+
+    private:
+        std::vector<shared_ptr<hittable>> objects;
+        aabb bbox;
+        mutable std::atomic<const bvh_node*> tree{nullptr};
+
+        const bvh_node& subtree() const {
+            auto built = tree.load(std::memory_order_acquire);
+            if (built) return *built;
+
+            auto fresh = new bvh_node(objects, 0, objects.size());
+            if (tree.compare_exchange_strong(built, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
+                return *fresh;
+
+            delete fresh;
+            return *built;
+        }
+};
+
+class lazy_bvh : public hittable {
+    public:
+        // A BVH whose top levels are built up front and whose lower levels wait for rays, so
+        // rendering can start sooner and parts of the scene no ray reaches are never built.
+        // The objects are partitioned by the same SAH object splits bvh_node makes until the
+        // groups hold at most group_size; each group becomes a deferred_bvh, under an
+        // ordinary BVH over the groups' boxes.
+        lazy_bvh(const hittable_list& list) {
+            std::vector<bvh_node::bvh_prim> prims;
+            prims.reserve(list.objects.size());
+
+            for (size_t i = 0; i < list.objects.size(); i++) {
+                auto box = list.objects[i]->bounding_box();
+                prims.push_back({ box, box.centroid(), i });
+            }
+
+            hittable_list groups;
+            if (!prims.empty()) split(list.objects, prims, 0, prims.size(), groups);
+            top = make_shared<bvh_node>(groups);
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            return top->hit(r, ray_t, rec);
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            return top->occluded(r, ray_t);
+        }
+
+        aabb bounding_box() const override { return top->bounding_box(); }
+
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            top->collect_lights(lights);
+        }
+
+        size_t subtree_count() const { return subtrees.size(); }
+
+        size_t built_count() const {
+            return std::count_if(subtrees.begin(), subtrees.end(),
+                [](const shared_ptr<deferred_bvh>& s) { return s->is_built(); });
+        }
+
+    private:
+        static constexpr size_t group_size = 1024;
+        static constexpr size_t split_sample_size = 1024;
+
+        shared_ptr<bvh_node> top;
+        std::vector<shared_ptr<deferred_bvh>> subtrees;
+
+        void split(const std::vector<shared_ptr<hittable>>& objects, std::vector<bvh_node::bvh_prim>& prims,
+                   size_t start, size_t end, hittable_list& groups) {
+            auto count = end - start;
+
+            if (count <= group_size) {
+                std::vector<shared_ptr<hittable>> group;
+                aabb bounds;
+                group.reserve(count);
+                for (size_t i = start; i < end; i++) {
+                    group.push_back(objects[prims[i].index]);
+                    bounds = aabb(bounds, prims[i].box);
+                }
+
+                auto subtree = make_shared<deferred_bvh>(std::move(group), bounds);
+                subtrees.push_back(subtree);
+                groups.add(subtree);
+                return;
+            }
+
+            // The plane is chosen from an evenly spaced sample of the range, so each level
+            // costs one pass to partition rather than binning every reference on every axis.
+            std::vector<bvh_node::bvh_prim> sample;
+            auto stride = std::max<size_t>(1, count / split_sample_size);
+            for (size_t i = start; i < end; i += stride) sample.push_back(prims[i]);
+
+            aabb bounds, centroid_bounds;
+            for (const auto& p : sample) {
+                bounds = aabb(bounds, p.box);
+                centroid_bounds = aabb(centroid_bounds, aabb(p.centroid, p.centroid));
+            }
+
+            int axis, plane;
+            bvh_node::find_split(sample, 0, sample.size(), bounds, centroid_bounds, axis, plane);
+
+            auto mid = start;
+            if (axis >= 0) {
+                mid = std::partition(prims.begin() + start, prims.begin() + end, [&](const bvh_node::bvh_prim& p) {
+                    return bvh_node::bin_of(p.centroid[axis], centroid_bounds.axis(axis)) < plane;
+                }) - prims.begin();
+            }
+
+            if (mid == start || mid == end) {
+                // Nothing in the sample separates the range; split at the median instead.
+                axis = bvh_node::longest_axis(centroid_bounds);
+                mid = start + count / 2;
+                std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+                    [axis](const bvh_node::bvh_prim& a, const bvh_node::bvh_prim& b) {
+                        return a.centroid[axis] < b.centroid[axis];
+                    });
+            }
+
+            split(objects, prims, start, mid, groups);
+            split(objects, prims, mid, end, groups);
+        }
+};
+
+#endif
\ No newline at end of file
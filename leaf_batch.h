@@ -0,0 +1,397 @@
+#ifndef LEAF_BATCH_H
+#define LEAF_BATCH_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "quad.h"
+#include "sphere.h"
+#include "wide_bvh.h"
+
+#include <cstdint>
+#include <cstring>
+#include <typeinfo>
+#include <vector>
+
+// The native vector of doubles for the instruction set wide_bvh.h selected: 4 lanes with AVX2,
+// 2 with SSE2 or NEON, and plain doubles otherwise. Comparisons return all-ones lanes.
+#if defined(RT_BVH_AVX2)
+struct double_simd {
+    using type = __m256d;
+    static constexpr int width = 4;
+
+    static type load(const double* p) { return _mm256_load_pd(p); }
+    static void store(double* p, type a) { _mm256_store_pd(p, a); }
+    static type broadcast(double x) { return _mm256_set1_pd(x); }
+    static type add(type a, type b) { return _mm256_add_pd(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_pd(a, b); }
+    static type mul(type a, type b) { return _mm256_mul_pd(a, b); }
+    static type div(type a, type b) { return _mm256_div_pd(a, b); }
+    static type sqrt(type a) { return _mm256_sqrt_pd(a); }
+    static type less(type a, type b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static type less_equal(type a, type b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    static type both(type a, type b) { return _mm256_and_pd(a, b); }
+    static type either(type a, type b) { return _mm256_or_pd(a, b); }
+    static type select(type m, type a, type b) { return _mm256_blendv_pd(b, a, m); }
+    static int bits(type m) { return _mm256_movemask_pd(m); }
+};
+#elif defined(RT_BVH_SSE)
+struct double_simd {
+    using type = __m128d;
+    static constexpr int width = 2;
+
+    static type load(const double* p) { return _mm_load_pd(p); }
+    static void store(double* p, type a) { _mm_store_pd(p, a); }
+    static type broadcast(double x) { return _mm_set1_pd(x); }
+    static type add(type a, type b) { return _mm_add_pd(a, b); }
+    static type sub(type a, type b) { return _mm_sub_pd(a, b); }
+    static type mul(type a, type b) { return _mm_mul_pd(a, b); }
+    static type div(type a, type b) { return _mm_div_pd(a, b); }
+    static type sqrt(type a) { return _mm_sqrt_pd(a); }
+    static type less(type a, type b) { return _mm_cmplt_pd(a, b); }
+    static type less_equal(type a, type b) { return _mm_cmple_pd(a, b); }
+    static type both(type a, type b) { return _mm_and_pd(a, b); }
+    static type either(type a, type b) { return _mm_or_pd(a, b); }
+    static type select(type m, type a, type b) { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+    static int bits(type m) { return _mm_movemask_pd(m); }
+};
+#elif defined(RT_BVH_NEON)
+struct double_simd {
+    using type = float64x2_t;
+    static constexpr int width = 2;
+
+    static type load(const double* p) { return vld1q_f64(p); }
+    static void store(double* p, type a) { vst1q_f64(p, a); }
+    static type broadcast(double x) { return vdupq_n_f64(x); }
+    static type add(type a, type b) { return vaddq_f64(a, b); }
+    static type sub(type a, type b) { return vsubq_f64(a, b); }
+    static type mul(type a, type b) { return vmulq_f64(a, b); }
+    static type div(type a, type b) { return vdivq_f64(a, b); }
+    static type sqrt(type a) { return vsqrtq_f64(a); }
+    static type less(type a, type b) { return vreinterpretq_f64_u64(vcltq_f64(a, b)); }
+    static type less_equal(type a, type b) { return vreinterpretq_f64_u64(vcleq_f64(a, b)); }
+    static type both(type a, type b) { return vreinterpretq_f64_u64(vandq_u64(vreinterpretq_u64_f64(a), vreinterpretq_u64_f64(b))); }
+    static type either(type a, type b) { return vreinterpretq_f64_u64(vorrq_u64(vreinterpretq_u64_f64(a), vreinterpretq_u64_f64(b))); }
+    static type select(type m, type a, type b) { return vbslq_f64(vreinterpretq_u64_f64(m), a, b); }
+    static int bits(type m) {
+        auto u = vreinterpretq_u64_f64(m);
+        return static_cast<int>((vgetq_lane_u64(u, 0) & 1) | ((vgetq_lane_u64(u, 1) & 1) << 1));
+    }
+};
+#else
+struct double_simd {
+    using type = double;
+    static constexpr int width = 1;
+
+    static type load(const double* p) { return *p; }
+    static void store(double* p, type a) { *p = a; }
+    static type broadcast(double x) { return x; }
+    static type add(type a, type b) { return a + b; }
+    static type sub(type a, type b) { return a - b; }
+    static type mul(type a, type b) { return a * b; }
+    static type div(type a, type b) { return a / b; }
+    static type sqrt(type a) { return std::sqrt(a); }
+    static type less(type a, type b) { return mask(a < b); }
+    static type less_equal(type a, type b) { return mask(a <= b); }
+    static type both(type a, type b) { return mask(bits(a) && bits(b)); }
+    static type either(type a, type b) { return mask(bits(a) || bits(b)); }
+    static type select(type m, type a, type b) { return bits(m) ? a : b; }
+
+    static int bits(type m) {
+        uint64_t u;
+        std::memcpy(&u, &m, sizeof u);
+        return u != 0;
+    }
+
+    static type mask(bool set) {
+        uint64_t u = set ? ~uint64_t(0) : 0;
+        double m;
+        std::memcpy(&m, &u, sizeof m);
+        return m;
+    }
+};
+#endif
+
+// W doubles, one per primitive in a batch, as W / double_simd::width native vectors.
+template <int W>
+struct double_lanes {
+    static_assert(W % double_simd::width == 0, "lanes must fill whole vectors");
+    static constexpr int parts = W / double_simd::width;
+    using simd = double_simd;
+
+    simd::type v[parts];
+
+    static double_lanes load(const double* p) {
+        double_lanes r;
+        for (int i = 0; i < parts; i++) r.v[i] = simd::load(p + i * simd::width);
+        return r;
+    }
+
+    static double_lanes broadcast(double x) {
+        double_lanes r;
+        for (int i = 0; i < parts; i++) r.v[i] = simd::broadcast(x);
+        return r;
+    }
+
+    void store(double* p) const {
+        for (int i = 0; i < parts; i++) simd::store(p + i * simd::width, v[i]);
+    }
+
+    int bits() const {
+        int b = 0;
+        for (int i = 0; i < parts; i++) b |= simd::bits(v[i]) << (i * simd::width);
+        return b;
+    }
+
+    template <typename Op>
+    static double_lanes map(const double_lanes& a, const double_lanes& b, Op op) {
+        double_lanes r;
+        for (int i = 0; i < parts; i++) r.v[i] = op(a.v[i], b.v[i]);
+        return r;
+    }
+
+    friend double_lanes operator+(const double_lanes& a, const double_lanes& b) { return map(a, b, simd::add); }
+    friend double_lanes operator-(const double_lanes& a, const double_lanes& b) { return map(a, b, simd::sub); }
+    friend double_lanes operator*(const double_lanes& a, const double_lanes& b) { return map(a, b, simd::mul); }
+    friend double_lanes operator/(const double_lanes& a, const double_lanes& b) { return map(a, b, simd::div); }
+    friend double_lanes operator<(const double_lanes& a, const double_lanes& b) { return map(a, b, simd::less); }
+    friend double_lanes operator<=(const double_lanes& a, const double_lanes& b) { return map(a, b, simd::less_equal); }
+    friend double_lanes operator&(const double_lanes& a, const double_lanes& b) { return map(a, b, simd::both); }
+    friend double_lanes operator|(const double_lanes& a, const double_lanes& b) { return map(a, b, simd::either); }
+    friend double_lanes sqrt(const double_lanes& a) { return map(a, a, [](simd::type x, simd::type) { return simd::sqrt(x); }); }
+
+    friend double_lanes select(const double_lanes& m, const double_lanes& a, const double_lanes& b) {
+        double_lanes r;
+        for (int i = 0; i < parts; i++) r.v[i] = simd::select(m.v[i], a.v[i], b.v[i]);
+        return r;
+    }
+};
+
+// Two instructions' worth of lanes: eight with AVX2, four with SSE2 or NEON.
+#if defined(RT_BVH_AVX2)
+constexpr int leaf_batch_width = 8;
+#else
+constexpr int leaf_batch_width = 4;
+#endif
+
+template <typename Batch, typename Primitive, int W>
+class leaf_batch : public hittable {
+    public:
+        // Up to W primitives of one kind, stored as arrays of doubles. One pass of SIMD
+        // arithmetic intersects the ray with all of them, doing the same operations as the
+        // primitive's own test, so the results are the ones it would give. Only the nearest
+        // lane's primitive is read, by its finalize_hit. Rays spend one virtual call on the
+        // batch instead of one per primitive, and read a few contiguous arrays instead of an
+        // object per primitive.
+        leaf_batch(std::vector<shared_ptr<Primitive>> group) : prims(std::move(group)) {
+            for (const auto& p : prims) bbox = aabb(bbox, p->bounding_box());
+            in_use = (1 << prims.size()) - 1;
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            lane_hits hits;
+            int bits = self().intersect(r, ray_t, hits) & in_use;
+            if (!bits) return false;
+
+            // The lowest lane wins a tie, as the first object of a leaf does.
+            int nearest = -1;
+            for (int i = 0; i < W; i++)
+                if ((bits & (1 << i)) && (nearest < 0 || hits.t[i] < hits.t[nearest])) nearest = i;
+
+            rec.t = hits.t[nearest];
+            rec.object = this->prims[nearest].get();
+            self().keep_coordinates(nearest, hits, rec);
+            return true;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            lane_hits hits;
+            return (self().intersect(r, ray_t, hits) & in_use) != 0;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            for (const auto& p : prims) p->collect_lights(lights);
+        }
+
+    protected:
+        using lanes = double_lanes<W>;
+
+        struct lane_hits {
+            alignas(32) double t[W];
+            alignas(32) double u[W];    // The plane coordinates, for batches whose test has them
+            alignas(32) double v[W];
+        };
+
+        std::vector<shared_ptr<Primitive>> prims;
+        aabb bbox;
+        int in_use;
+
+        const Batch& self() const { return static_cast<const Batch&>(*this); }
+
+        template <typename Get>
+        static void fill(double* lane, const std::vector<shared_ptr<Primitive>>& group, Get get) {
+            // Lanes past the group get zeros, and in_use masks them out.
+            for (int i = 0; i < W; i++) lane[i] = i < static_cast<int>(group.size()) ? get(*group[i]) : 0.0;
+        }
+};
+
+template <int W>
+class sphere_batch : public leaf_batch<sphere_batch<W>, sphere, W> {
+    public:
+        sphere_batch(std::vector<shared_ptr<sphere>> group) : leaf_batch<sphere_batch<W>, sphere, W>(std::move(group)) {
+            for (int a = 0; a < 3; a++)
+                this->fill(center[a], this->prims, [a](const sphere& s) { return s.center1[a]; });
+            this->fill(radius_squared, this->prims, [](const sphere& s) { return s.radius * s.radius; });
+        }
+
+        static bool batchable(const sphere& s) { return !s.is_moving; }
+
+    private:
+        using base = leaf_batch<sphere_batch<W>, sphere, W>;
+        using typename base::lanes;
+        using typename base::lane_hits;
+        friend base;
+
+        alignas(32) double center[3][W];
+        alignas(32) double radius_squared[W];
+
+        int intersect(const ray& r, const interval& ray_t, lane_hits& hits) const {
+            // sphere::nearest_root, a lane at a time.
+            const auto& d = r.direction();
+            auto dx = lanes::broadcast(d.x()), dy = lanes::broadcast(d.y()), dz = lanes::broadcast(d.z());
+            auto a = lanes::broadcast(d.length_squared());
+
+            auto ocx = lanes::broadcast(r.origin().x()) - lanes::load(center[0]);
+            auto ocy = lanes::broadcast(r.origin().y()) - lanes::load(center[1]);
+            auto ocz = lanes::broadcast(r.origin().z()) - lanes::load(center[2]);
+
+            auto half_b = ocx*dx + ocy*dy + ocz*dz;
+            auto c = (ocx*ocx + ocy*ocy + ocz*ocz) - lanes::load(radius_squared);
+            auto discriminant = half_b*half_b - a*c;
+
+            auto zero = lanes::broadcast(0);
+            auto real = zero <= discriminant;
+            auto sqrtd = sqrt(select(real, discriminant, zero));
+            auto tmin = lanes::broadcast(ray_t.min), tmax = lanes::broadcast(ray_t.max);
+
+            auto near_root = (zero - half_b - sqrtd) / a;
+            auto far_root = (zero - half_b + sqrtd) / a;
+            auto near_hit = real & (tmin < near_root) & (near_root < tmax);
+            auto far_hit = real & (tmin < far_root) & (far_root < tmax);
+
+            select(near_hit, near_root, far_root).store(hits.t);
+            return (near_hit | far_hit).bits();
+        }
+
+        void keep_coordinates(int lane, const lane_hits& hits, hit_record& rec) const {}
+};
+
+template <int W>
+class quad_batch : public leaf_batch<quad_batch<W>, quad, W> {
+    public:
+        quad_batch(std::vector<shared_ptr<quad>> group) : leaf_batch<quad_batch<W>, quad, W>(std::move(group)) {
+            for (int a = 0; a < 3; a++) {
+                this->fill(Q[a], this->prims, [a](const quad& q) { return q.Q[a]; });
+                this->fill(u[a], this->prims, [a](const quad& q) { return q.u[a]; });
+                this->fill(v[a], this->prims, [a](const quad& q) { return q.v[a]; });
+                this->fill(w[a], this->prims, [a](const quad& q) { return q.w[a]; });
+                this->fill(normal[a], this->prims, [a](const quad& q) { return q.normal[a]; });
+            }
+            this->fill(D, this->prims, [](const quad& q) { return q.D; });
+        }
+
+        // Subclasses of quad change is_interior, which the batch test does not know about.
+        static bool batchable(const quad& q) { return typeid(q) == typeid(quad); }
+
+    private:
+        using base = leaf_batch<quad_batch<W>, quad, W>;
+        using typename base::lanes;
+        using typename base::lane_hits;
+        friend base;
+
+        alignas(32) double Q[3][W], u[3][W], v[3][W], w[3][W];
+        alignas(32) double normal[3][W];
+        alignas(32) double D[W];
+
+        int intersect(const ray& r, const interval& ray_t, lane_hits& hits) const {
+            // quad::plane_hit and quad::is_interior, a lane at a time.
+            lanes o[3], d[3], n[3];
+            for (int a = 0; a < 3; a++) {
+                o[a] = lanes::broadcast(r.origin()[a]);
+                d[a] = lanes::broadcast(r.direction()[a]);
+                n[a] = lanes::load(normal[a]);
+            }
+
+            auto denom = n[0]*d[0] + n[1]*d[1] + n[2]*d[2];
+            auto t = (lanes::load(D) - (n[0]*o[0] + n[1]*o[1] + n[2]*o[2])) / denom;
+
+            auto zero = lanes::broadcast(0), one = lanes::broadcast(1);
+            auto epsilon = lanes::broadcast(1e-8);
+            auto crossing = (epsilon <= denom) | (denom <= zero - epsilon);
+            auto in_range = (lanes::broadcast(ray_t.min) <= t) & (t <= lanes::broadcast(ray_t.max));
+
+            lanes p[3], qu[3], qv[3], qw[3];
+            for (int a = 0; a < 3; a++) {
+                p[a] = (o[a] + t * d[a]) - lanes::load(Q[a]);
+                qu[a] = lanes::load(u[a]);
+                qv[a] = lanes::load(v[a]);
+                qw[a] = lanes::load(w[a]);
+            }
+
+            auto alpha = qw[0] * (p[1]*qv[2] - p[2]*qv[1]) + qw[1] * (p[2]*qv[0] - p[0]*qv[2]) + qw[2] * (p[0]*qv[1] - p[1]*qv[0]);
+            auto beta = qw[0] * (qu[1]*p[2] - qu[2]*p[1]) + qw[1] * (qu[2]*p[0] - qu[0]*p[2]) + qw[2] * (qu[0]*p[1] - qu[1]*p[0]);
+            auto interior = (zero <= alpha) & (alpha <= one) & (zero <= beta) & (beta <= one);
+
+            t.store(hits.t);
+            alpha.store(hits.u);
+            beta.store(hits.v);
+            return (crossing & in_range & interior).bits();
+        }
+
+        void keep_coordinates(int lane, const lane_hits& hits, hit_record& rec) const {
+            // What quad::is_interior would have left for quad::finalize_hit.
+            rec.u = hits.u[lane];
+            rec.v = hits.v[lane];
+        }
+};
+
+template <int W>
+std::vector<shared_ptr<hittable>> pack_leaf(const std::vector<shared_ptr<hittable>>& prims) {
+    // A leaf's stationary spheres become one batch and its plain quads another; the rest, and
+    // a kind with only one primitive, stay as they are.
+    std::vector<shared_ptr<hittable>> packed;
+    std::vector<shared_ptr<sphere>> spheres;
+    std::vector<shared_ptr<quad>> quads;
+
+    for (const auto& object : prims) {
+        auto s = std::dynamic_pointer_cast<sphere>(object);
+        auto q = std::dynamic_pointer_cast<quad>(object);
+        if (s && sphere_batch<W>::batchable(*s)) spheres.push_back(s);
+        else if (q && quad_batch<W>::batchable(*q)) quads.push_back(q);
+        else packed.push_back(object);
+    }
+
+    if (spheres.size() > 1) packed.push_back(make_shared<sphere_batch<W>>(std::move(spheres)));
+    else packed.insert(packed.end(), spheres.begin(), spheres.end());
+
+    if (quads.size() > 1) packed.push_back(make_shared<quad_batch<W>>(std::move(quads)));
+    else packed.insert(packed.end(), quads.begin(), quads.end());
+
+    return packed;
+}
+
+// A batch's test, in units of one primitive's. Timed, a full batch costs about what one
+// primitive tested the usual way does: the arithmetic is cheaper, the hit record the same.
+constexpr double leaf_batch_cost = 1.0;
+
+template <int W = leaf_batch_width>
+void batch_leaves(bvh_node& tree) {
+    // Collapses the tree's subtrees of up to W primitives into leaves, where the SAH says a
+    // batch is cheaper, and packs each leaf's spheres and quads into batches. Layouts derived
+    // from the tree afterwards (wide_bvh, compressed_bvh) hold the batches too.
+    tree.collapse_leaves(W, leaf_batch_cost, pack_leaf<W>);
+}
+
+#endif
\ No newline at end of file
@@ -1,22 +1,51 @@
 #include "rtweekend.h"
 
+#include "box.h"
 #include "bvh.h"
 #include "camera.h"
 #include "color.h"
+#include "compressed_bvh.h"
 #include "constant_medium.h"
 #include "hittable_list.h"
+#include "lazy_bvh.h"
+#include "leaf_batch.h"
 #include "material.h"
+#include "motion_bvh.h"
 #include "quad.h"
+#include "scene_arena.h"
 #include "sphere.h"
 #include "texture.h"
+#include "triangle_mesh.h"
+#include "wide_bvh.h"
 
+#include <atomic>
 #include <chrono>
 
+std::chrono::system_clock::duration bvh_build_time{};
+
+shared_ptr<hittable> build_bvh(const hittable_list& list) {
+    // Builds on the same shared pool the camera renders with, and keeps the time apart from
+    // the render time. The binary tree is then collapsed into the widest nodes this build's
+    // SIMD slab test handles, unless motion blur stretches its bounds so far that nodes with
+    // bounds at both ends of the shutter make up for their slower traversal.
+    auto start = std::chrono::system_clock::now();
+    bvh_node bvh(list, shared_thread_pool());
+    auto stats = bvh.stats();
+    auto motion = make_shared<motion_bvh>(bvh);
+    shared_ptr<hittable> tree = motion;
+    if (motion->sah_cost() > 0.25 * stats.sah_cost) tree = make_wide_bvh(bvh);
+    bvh_build_time += std::chrono::system_clock::now() - start;
+
+    stats.print(std::clog);
+    return tree;
+}
+
 void random_spheres() {
+    scene_arena arena;     // First, so it outlives everything that uses the scene
     hittable_list world;
 
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    auto checker = arena.make<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+    world.add(arena.make<sphere>(point3(0, -1000, 0), 1000, arena.make<lambertian>(checker)));
 
     // auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
     // world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
@@ -32,37 +61,37 @@ void random_spheres() {
                 if(choose_mat < 0.8) {
                     // diffuse
                     auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
+                    sphere_material = arena.make<lambertian>(arena.make<solid_color>(albedo));
                     auto center2 = center + vec3(0, random_double(0, .5), 0);
                 
-                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
+                    world.add(arena.make<sphere>(center, center2, 0.2, sphere_material));
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
+                    sphere_material = arena.make<metal>(albedo, fuzz);
                 
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
                 } else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
+                    sphere_material = arena.make<dielectric>(1.5);
                 
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
                 }
             }
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    auto material1 = arena.make<dielectric>(1.5);
+    world.add(arena.make<sphere>(point3(0, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    auto material2 = arena.make<lambertian>(arena.make<solid_color>(0.4, 0.2, 0.1));
+    world.add(arena.make<sphere>(point3(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    auto material3 = arena.make<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(arena.make<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(build_bvh(world));
 
     camera cam;
     
@@ -244,15 +273,15 @@ void cornell_box() {
     // world.add(make_shared<quad>(point3(343,554,332), vec3(-130,0,0),vec3(0,0,-105), light));
     world.add(make_shared<quad>(point3(213,554,227), vec3(130,0,0), vec3(0,0,105), light));
 
-    // world.add(box(point3(130,0,65), point3(295,165,230), white));
-    // world.add(box(point3(265,0,295), point3(430,330,460), white));
+    // world.add(make_shared<box>(point3(130,0,65), point3(295,165,230), white));
+    // world.add(make_shared<box>(point3(265,0,295), point3(430,330,460), white));
 
-    shared_ptr<hittable> box1 = box(point3(0), point3(165,330,165), white);
+    shared_ptr<hittable> box1 = make_shared<box>(point3(0), point3(165,330,165), white);
     box1 = make_shared<rotate_y>(box1, 15);
     box1 = make_shared<translate>(box1, vec3(265,0,295));
     world.add(box1);
 
-    shared_ptr<hittable> box2 = box(point3(0), point3(165), white);
+    shared_ptr<hittable> box2 = make_shared<box>(point3(0), point3(165), white);
     box2 = make_shared<rotate_y>(box2,-18);
     box2 = make_shared<translate>(box2, vec3(130,0,65));
     world.add(box2);
@@ -276,6 +305,62 @@ void cornell_box() {
     cam.render(world);
 }
 
+bool cornell_mesh(const char* filename) {
+    // A mesh loaded from an OBJ or PLY file, scaled to stand 330 units tall on the floor of
+    // the Cornell box. Returns false, without rendering, if the file has no triangles.
+    hittable_list world;
+
+    auto red    = make_shared<lambertian>(color(.65, .05, .05));
+    auto white  = make_shared<lambertian>(color(.73));
+    auto green  = make_shared<lambertian>(color(.12, .45, .15));
+    auto light  = make_shared<diffuse_light>(color(15));
+
+    world.add(make_shared<quad>(point3(555,0,0), vec3(0,0,555), vec3(0,555,0), green));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(0,0,-555), vec3(0,555,0), red));
+    world.add(make_shared<quad>(point3(0,555,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,0,-555), white));
+    world.add(make_shared<quad>(point3(555,0,555), vec3(-555,0,0), vec3(0,555,0), white));
+    world.add(make_shared<quad>(point3(213,554,227), vec3(130,0,0), vec3(0,0,105), light));
+
+    auto start = std::chrono::system_clock::now();
+    auto mesh = make_shared<triangle_mesh>(filename, white);
+    auto load_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start).count();
+    std::clog << "Mesh: " << mesh->triangle_count() << " triangles, " << mesh->vertex_count() << " vertices, loaded in "
+              << load_ms << "ms\n";
+
+    auto bounds = mesh->bounding_box();
+    auto extent = std::max({ bounds.x.size(), bounds.y.size(), bounds.z.size() });
+    if (mesh->triangle_count() == 0 || !(extent > 0)) {
+        std::cerr << "ERROR: Mesh file '" << filename << "' has no triangles to render.\n";
+        return false;
+    }
+
+    auto base = point3(bounds.x.min + bounds.x.size() / 2, bounds.y.min, bounds.z.min + bounds.z.size() / 2);
+    auto placement = affine::translation(vec3(278, 0, 278)) * affine::scaling(vec3(330 / extent))
+                   * affine::translation(-base);
+    world.add(make_shared<instance>(mesh, placement));
+
+    world = hittable_list(build_bvh(world));
+
+    camera cam;
+
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 600;
+    cam.samples_per_pixel = 100;
+    cam.max_depth         = 50;
+    cam.background        = color(0);
+
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+    return true;
+}
+
 void cornell_smoke() {
     hittable_list world;
 
@@ -291,11 +376,11 @@ void cornell_smoke() {
     world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
     world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
 
-    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
+    shared_ptr<hittable> box1 = make_shared<box>(point3(0,0,0), point3(165,330,165), white);
     box1 = make_shared<rotate_y>(box1, 15);
     box1 = make_shared<translate>(box1, vec3(265,0,295));
 
-    shared_ptr<hittable> box2 = box(point3(0,0,0), point3(165,165,165), white);
+    shared_ptr<hittable> box2 = make_shared<box>(point3(0,0,0), point3(165,165,165), white);
     box2 = make_shared<rotate_y>(box2, -18);
     box2 = make_shared<translate>(box2, vec3(130,0,65));
 
@@ -322,10 +407,12 @@ void cornell_smoke() {
 }
 
 void final_scene(int image_width, int samples_per_pixel, int max_depth) {
+    scene_arena arena;     // First, so it outlives everything that uses the scene
     hittable_list boxes1;
-    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+    auto ground = arena.make<lambertian>(arena.make<solid_color>(0.48, 0.83, 0.53));
 
-    // Floor boxes
+    // Floor boxes: instances of one unit box, each scaled to its height and moved into place
+    auto unit_box = arena.make<box>(point3(0,0,0), point3(1,1,1), ground);
     int boxes_per_side = 20;
     for (int i = 0; i < boxes_per_side; i++) {
         for (int j = 0; j < boxes_per_side; j++) {
@@ -334,62 +421,61 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
             auto z0 = -1000.0 + j *w;
             auto y0 = 0.0;
 
-            auto x1 = x0 + w;
             auto y1 = random_double(1,101);
-            auto z1 = z0 +w;
 
-            boxes1.add(box(point3(x0, y0, z0), point3(x1, y1, z1), ground));
+            auto place = affine::translation(vec3(x0, y0, z0)) * affine::scaling(vec3(w, y1 - y0, w));
+            boxes1.add(arena.make<instance>(unit_box, place));
         }
     }
 
     hittable_list world;
 
-    world.add(make_shared<bvh_node>(boxes1));
+    world.add(build_bvh(boxes1));
 
-    auto light = make_shared<diffuse_light>(color(7,7,7));
-    world.add(make_shared<quad>(point3(123,554,147), vec3(300,0,0), vec3(0,0,265), light));
+    auto light = arena.make<diffuse_light>(arena.make<solid_color>(7, 7, 7));
+    world.add(arena.make<quad>(point3(123,554,147), vec3(300,0,0), vec3(0,0,265), light));
 
     // Moving sphere
     auto center1 = point3(400, 400, 200);
     auto center2 = center1 + vec3(30, 0, 0);
-    auto sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
-    world.add(make_shared<sphere>(center1, center2, 50, sphere_material));
+    auto sphere_material = arena.make<lambertian>(arena.make<solid_color>(0.7, 0.3, 0.1));
+    world.add(arena.make<sphere>(center1, center2, 50, sphere_material));
 
     // Glass ball
-    world.add(make_shared<sphere>(point3(260,150,45), 50, make_shared<dielectric>(1.5)));
+    world.add(arena.make<sphere>(point3(260,150,45), 50, arena.make<dielectric>(1.5)));
 
     // Metal ball
-    world.add(make_shared<sphere>(point3(0,150,145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)));
+    world.add(arena.make<sphere>(point3(0,150,145), 50, arena.make<metal>(color(0.8, 0.8, 0.9), 1.0)));
 
     // Blue SSS ball
-    auto boundary = make_shared<sphere>(point3(360,150,145), 70, make_shared<dielectric>(1.5));
+    auto boundary = arena.make<sphere>(point3(360,150,145), 70, arena.make<dielectric>(1.5));
     world.add(boundary);
-    world.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
+    world.add(arena.make<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
 
     // Scene fog
-    boundary = make_shared<sphere>(point3(0,0,0), 5000, make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(boundary, .0001, color(1,1,1)));
+    boundary = arena.make<sphere>(point3(0,0,0), 5000, arena.make<dielectric>(1.5));
+    world.add(arena.make<constant_medium>(boundary, .0001, color(1,1,1)));
 
     // Earth ball
-    auto emat = make_shared<lambertian>(make_shared<image_texture>("textures/earthmap.jpg"));
-    world.add(make_shared<sphere>(point3(400, 200, 400), 100, emat));
+    auto emat = arena.make<lambertian>(arena.make<image_texture>("textures/earthmap.jpg"));
+    world.add(arena.make<sphere>(point3(400, 200, 400), 100, emat));
 
     // Perlin ball
-    auto pertext = make_shared<noise_texture>(0.1);
-    world.add(make_shared<sphere>(point3(220,280,300), 80, make_shared<lambertian>(pertext)));
+    auto pertext = arena.make<noise_texture>(0.1);
+    world.add(arena.make<sphere>(point3(220,280,300), 80, arena.make<lambertian>(pertext)));
 
     // Cube of balls
     hittable_list boxes2;
-    auto white = make_shared<lambertian>(color(.73,.73,.73));
+    auto white = arena.make<lambertian>(arena.make<solid_color>(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0, 165), 10, white));
+        boxes2.add(arena.make<sphere>(point3::random(0, 165), 10, white));
     }
 
     world.add(
-        make_shared<translate>(
-            make_shared<rotate_y>(
-                make_shared<bvh_node>(boxes2), 15),
+        arena.make<translate>(
+            arena.make<rotate_y>(
+                build_bvh(boxes2), 15),
                 vec3(-100, 270, 395)
         )
     );
@@ -447,6 +533,8 @@ void density_test() {
     world.add(boundary);
     world.add(make_shared<constant_medium>(boundary, 0.1, color(0.2, 0.4, 0.9)));
 
+    world = hittable_list(build_bvh(world));
+
     camera cam;
 
     cam.aspect_ratio      = 1.0;
@@ -498,6 +586,8 @@ void bubble() {
     // auto emat = make_shared<diffuse_light>(make_shared<image_texture>("textures/earthmap.jpg"));
     // world.add(make_shared<sphere>(point3(190,160,145), -1500, emat));
 
+    world = hittable_list(build_bvh(world));
+
     camera cam;
 
     cam.aspect_ratio      = 1.0;
@@ -520,7 +610,122 @@ void bubble() {
     cam.render(world);
 }
 
-int main() {
+double trace_rate(const hittable& tree, const std::vector<ray>& rays, size_t& hits) {
+    // Closest-hit queries per second, in millions, on the shared pool.
+    const size_t chunk = 4096;
+    std::atomic<size_t> hit_count(0);
+
+    auto start = std::chrono::system_clock::now();
+    shared_thread_pool().parallel_for((rays.size() + chunk - 1) / chunk, [&](size_t c, int) {
+        size_t n = 0;
+        for (size_t i = c * chunk; i < std::min(rays.size(), (c + 1) * chunk); i++) {
+            hit_record rec;
+            if (tree.hit(rays[i], interval(0.001, infinity), rec)) n++;
+        }
+        hit_count += n;
+    });
+    std::chrono::duration<double> seconds = std::chrono::system_clock::now() - start;
+
+    hits = hit_count;
+    return rays.size() / seconds.count() * 1e-6;
+}
+
+void bvh_benchmark(int spheres) {
+    // Compares the BVH node layouts on final_scene's floor boxes and cube of balls, with the
+    // cube scaled up to the given number of balls: memory taken by the nodes, and primary
+    // rays traced per second from final_scene's camera.
+    hittable_list prims;
+    auto white = make_shared<lambertian>(color(.73,.73,.73));
+
+    for (int i = 0; i < 20; i++) {
+        for (int j = 0; j < 20; j++) {
+            auto x0 = -1000.0 + i * 100.0;
+            auto z0 = -1000.0 + j * 100.0;
+            prims.add(make_shared<box>(point3(x0, 0, z0), point3(x0 + 100, random_double(1,101), z0 + 100), white));
+        }
+    }
+
+    auto radius = 10 * std::cbrt(1000.0 / spheres);
+    for (int j = 0; j < spheres; j++)
+        prims.add(make_shared<sphere>(point3::random(0, 165) + vec3(-100, 270, 395), radius, white));
+
+    auto start = std::chrono::system_clock::now();
+    bvh_node binary(prims, shared_thread_pool());
+    auto eager_time = std::chrono::system_clock::now() - start;
+    bvh_build_time += eager_time;
+    binary.stats().print(std::clog);
+
+    wide_bvh<4> wide(binary);
+    compressed_bvh compressed(binary);
+
+    // The same trees calling every primitive through the vtable, for the direct calls to be
+    // measured against.
+    bvh_node virtual_binary = binary;
+    virtual_binary.set_direct_calls(false);
+    wide_bvh<4> virtual_wide(virtual_binary);
+
+    // The same trees with their small subtrees collapsed into leaves of SIMD batches.
+    bvh_node batched = binary;
+    batch_leaves(batched);
+    wide_bvh<4> batched_wide(batched);
+
+    const int size = 800;
+    auto lookfrom = point3(478,278,-600);
+    auto w = unit_vector(lookfrom - point3(278,278,0));
+    auto u = unit_vector(cross(vec3(0,1,0), w));
+    auto v = cross(w, u);
+    auto h = tan(degrees_to_radians(40) / 2);
+
+    std::vector<ray> rays;
+    rays.reserve(size * size);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            auto s = (2 * (x + 0.5) / size - 1) * h;
+            auto t = (1 - 2 * (y + 0.5) / size) * h;
+            rays.emplace_back(lookfrom, s*u + t*v - w);
+        }
+    }
+
+    struct layout {
+        const char* name;
+        const hittable& tree;
+        size_t bytes;
+    };
+
+    layout layouts[] = {
+        { "binary (32-byte nodes)    ", binary, binary.node_bytes() },
+        { "4-wide (128-byte nodes)   ", wide, wide.node_bytes() },
+        { "compressed (64-byte nodes)", compressed, compressed.node_bytes() },
+        { "binary, virtual calls     ", virtual_binary, virtual_binary.node_bytes() },
+        { "4-wide, virtual calls     ", virtual_wide, virtual_wide.node_bytes() },
+        { "binary, batched leaves    ", batched, batched.node_bytes() },
+        { "4-wide, batched leaves    ", batched_wide, batched_wide.node_bytes() },
+    };
+
+    for (const auto& l : layouts) {
+        size_t hits;
+        auto rate = trace_rate(l.tree, rays, hits);
+        std::clog << l.name << ": " << l.bytes / 1048576.0 << " MiB, " << rate << " Mrays/s ("
+                  << hits << " hits)\n";
+    }
+
+    // The lazy tree's first pass also builds every subtree the rays enter.
+    start = std::chrono::system_clock::now();
+    lazy_bvh lazy(prims);
+    auto lazy_time = std::chrono::system_clock::now() - start;
+
+    size_t hits;
+    auto first_pass = trace_rate(lazy, rays, hits);
+    auto second_pass = trace_rate(lazy, rays, hits);
+
+    auto eager_ms = std::chrono::duration_cast<std::chrono::milliseconds>(eager_time).count();
+    auto lazy_ms = std::chrono::duration_cast<std::chrono::milliseconds>(lazy_time).count();
+    std::clog << "Startup: eager build " << eager_ms << "ms, lazy build " << lazy_ms << "ms\n"
+              << "lazy: first pass " << first_pass << " Mrays/s, then " << second_pass << " Mrays/s ("
+              << lazy.built_count() << " of " << lazy.subtree_count() << " subtrees built)\n";
+}
+
+int main(int argc, char* argv[]) {
     auto start = std::chrono::system_clock::now();
 
     switch (7) {
@@ -535,10 +740,22 @@ int main() {
         case 9: final_scene(800, 10000, 40);    break;
         case 10: density_test();                break;
         case 11: bubble();                      break;
+        case 12: bvh_benchmark(1000000);        break;
+        case 13:
+            // The mesh is not part of the repository: pass the path to an OBJ or PLY file.
+            if (argc < 2) {
+                std::cerr << "usage: " << argv[0] << " <mesh.obj|mesh.ply>\n";
+                return 1;
+            }
+            if (!cornell_mesh(argv[1])) return 1;
+            break;
         // default: final_scene(400, 250, 16);      break;
         default: final_scene(800, 1000, 16);    break;
     }
 
     auto end = std::chrono::system_clock::now();
-    std::clog << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+    auto total_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(bvh_build_time).count();
+    std::clog << "BVH build: " << build_ms << "ms, render: " << total_ms - build_ms << "ms" << std::endl;
+    std::clog << total_ms << "ms" << std::endl;
 }
\ No newline at end of file
@@ -2,20 +2,31 @@
 #define MATERIAL_H
 
 #include "rtweekend.h"
+#include "color.h"
 #include "hittable.h"
 #include "texture.h"
 #include "onb.h"
+#include "sampler.h"
 
 class material {
     public:
         virtual ~material() = default;
 
-        virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+        virtual bool scatter(
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
+        ) const = 0;
 
         virtual color emitted(double u, double v, const point3& p) const {
             return color(0);
         }
 
+        // Whether objects with this material should be sampled as lights.
+        virtual bool is_emitter() const { return false; }
+
+        // For materials that importance-sample their BSDF exactly: the density with which
+        // scatter picks the scattered direction, which is also the BSDF times the cosine
+        // divided by the attenuation scatter returns. Zero for specular materials, which
+        // cannot be evaluated for an arbitrary direction.
         virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
             return 0;
         }
@@ -26,24 +37,24 @@ class lambertian : public material {
         lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
         lambertian(shared_ptr<texture> a) : albedo(a) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& alb, ray& scattered, double& pdf) const override {
+        bool scatter(
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
+        ) const override {
             onb uvw;
             uvw.build_from_w(rec.normal);
-            auto scatter_direction = uvw.local(random_cosine_direction());
+            auto scatter_direction = uvw.local(random_cosine_direction(s));
 
             // Catch degenerate scatter direction
             // if (scatter_direction.near_zero()) scatter_direction = rec.normal;
 
             scattered = ray(rec.p, unit_vector(scatter_direction), r_in.time());
-            alb = albedo->value(rec.u, rec.v, rec.p);
-            pdf = dot(uvw.w(), scattered.direction()) / pi;
+            attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
         }
 
-        double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
-            // auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
-            // return cos_theta < 0 ? 0 : cos_theta/pi;
-            return 1 / (2*pi);
+        double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+            auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+            return cos_theta < 0 ? 0 : cos_theta/pi;
         }
     
     private:
@@ -55,10 +66,10 @@ class metal : public material {
         metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
         bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const override {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+            scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(s), r_in.time());
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
@@ -73,7 +84,7 @@ class dielectric : public material {
         dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
         bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const override {
             attenuation = color(1.0);
             double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
@@ -85,7 +96,7 @@ class dielectric : public material {
             bool cannot_refract = refraction_ratio * sin_theta > 1.0;
             vec3 direction;
 
-            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > s.get_1d())
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -112,7 +123,7 @@ class diffuse_light : public material {
 
     
         bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const override {
             return false;
         }
@@ -120,6 +131,8 @@ class diffuse_light : public material {
         color emitted(double u, double v, const point3& p) const override {
             return emit->value(u,v,p);
         }
+
+        bool is_emitter() const override { return true; }
     private:
         shared_ptr<texture> emit;
 };
@@ -130,13 +143,17 @@ class isotropic : public material {
         isotropic(shared_ptr<texture> a) : albedo(a) {}
 
         bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const override {
-            scattered = ray(rec.p, random_unit_vector(), r_in.time());
+            scattered = ray(rec.p, random_unit_vector(s), r_in.time());
             attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
         }
 
+        double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+            return 1 / (4 * pi);
+        }
+
     private:
         shared_ptr<texture> albedo;
 };
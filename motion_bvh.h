@@ -0,0 +1,210 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+struct alignas(64) motion_node {
+    float lower[2][3];      // [time][axis]: bounds at the start and end of the shutter
+    float upper[2][3];
+    uint32_t offset;        // Leaf: first primitive. Interior: second child.
+    uint16_t count;         // Primitives in a leaf, 0 for an interior node
+    uint16_t axis;          // Interior: the split axis
+};
+
+class motion_bvh : public hittable {
+    public:
+        // A copy of a bvh_node's tree whose nodes hold their bounds at both ends of the
+        // shutter, from the objects' motion_bounds. Traversal interpolates them to the ray's
+        // time, so a node bounds where its moving objects are at that moment rather than
+        // everywhere they go while the shutter is open.
+        motion_bvh(const bvh_node& tree) : objects(tree.tree_objects()), primitives(tree.tree_primitives()) {
+            const auto& binary = tree.tree_nodes();
+            nodes.resize(binary.size());
+
+            // Children come after their parents, so a backwards pass fits them first.
+            for (size_t i = binary.size(); i-- > 0;) {
+                auto& node = nodes[i];
+                node.offset = binary[i].offset;
+                node.count = binary[i].count;
+                node.axis = binary[i].axis;
+
+                aabb start, end;
+                if (node.count > 0) {
+                    for (uint32_t k = node.offset; k < node.offset + node.count; k++) {
+                        aabb s, e;
+                        objects[k]->motion_bounds(s, e);
+                        start = aabb(start, s);
+                        end = aabb(end, e);
+                    }
+                } else {
+                    start = aabb(node_box(nodes[i + 1], 0), node_box(nodes[node.offset], 0));
+                    end = aabb(node_box(nodes[i + 1], 1), node_box(nodes[node.offset], 1));
+                }
+
+                for (int a = 0; a < 3; a++) {
+                    node.lower[0][a] = bvh_node::round_down(start.axis(a).min);
+                    node.upper[0][a] = bvh_node::round_up(start.axis(a).max);
+                    node.lower[1][a] = bvh_node::round_down(end.axis(a).min);
+                    node.upper[1][a] = bvh_node::round_up(end.axis(a).max);
+                }
+            }
+
+            if (!nodes.empty()) bbox = aabb(node_box(nodes[0], 0), node_box(nodes[0], 1));
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (nodes.empty()) return false;
+
+            motion_ray mr(r);
+            uint32_t stack[max_depth];
+            int top = 0;
+            uint32_t index = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                const auto& node = nodes[index];
+
+                if (mr.hit(node, ray_t)) {
+                    if (node.count > 0) {
+                        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                            if (primitives[i].hit(r, ray_t, rec)) {
+                                hit_anything = true;
+                                ray_t.max = rec.t;
+                            }
+                        }
+                    } else {
+                        if (mr.negative[node.axis]) {
+                            stack[top++] = index + 1;
+                            index = node.offset;
+                        } else {
+                            stack[top++] = node.offset;
+                            index = index + 1;
+                        }
+                        continue;
+                    }
+                }
+
+                if (top == 0) break;
+                index = stack[--top];
+            }
+
+            return hit_anything;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            motion_ray mr(r);
+            uint32_t stack[max_depth];
+            int top = 0;
+            uint32_t index = 0;
+
+            while (true) {
+                const auto& node = nodes[index];
+
+                if (mr.hit(node, ray_t)) {
+                    if (node.count > 0) {
+                        for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                            if (primitives[i].occluded(r, ray_t)) return true;
+                    } else {
+                        stack[top++] = node.offset;
+                        index = index + 1;
+                        continue;
+                    }
+                }
+
+                if (top == 0) break;
+                index = stack[--top];
+            }
+
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        void motion_bounds(aabb& start, aabb& end) const override {
+            if (nodes.empty()) {
+                start = end = bbox;
+                return;
+            }
+
+            start = node_box(nodes[0], 0);
+            end = node_box(nodes[0], 1);
+        }
+
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            collect_unique_lights(objects, lights);
+        }
+
+        size_t node_bytes() const { return nodes.size() * sizeof(motion_node); }
+
+        double sah_cost() const {
+            // The SAH cost averaged over the shutter, in the units of bvh_stats::sah_cost, so it
+            // can be set against the cost of the same tree with whole-shutter bounds. A box's
+            // area is quadratic in time, so Simpson's rule gives the average exactly.
+            auto root_area = bbox.surface_area();
+            double cost = 0;
+
+            for (const auto& node : nodes) {
+                auto mid = aabb(interval(0.5 * (node.lower[0][0] + node.lower[1][0]), 0.5 * (node.upper[0][0] + node.upper[1][0])),
+                                interval(0.5 * (node.lower[0][1] + node.lower[1][1]), 0.5 * (node.upper[0][1] + node.upper[1][1])),
+                                interval(0.5 * (node.lower[0][2] + node.lower[1][2]), 0.5 * (node.upper[0][2] + node.upper[1][2])));
+                auto area = (node_box(node, 0).surface_area() + 4 * mid.surface_area() + node_box(node, 1).surface_area()) / 6;
+                cost += bvh_node::node_cost(root_area > 0 ? area / root_area : 1.0, node.count);
+            }
+
+            return cost;
+        }
+
+    private:
+        static constexpr int max_depth = 64;
+
+        std::vector<motion_node> nodes;
+        std::vector<shared_ptr<hittable>> objects;
+        std::vector<primitive_ref> primitives;
+        aabb bbox;
+
+        struct motion_ray {
+            double origin[3];
+            double inv_direction[3];
+            bool negative[3];
+            double time;
+
+            motion_ray(const ray& r) : time(r.time()) {
+                for (int a = 0; a < 3; a++) {
+                    origin[a] = r.origin()[a];
+                    inv_direction[a] = 1 / r.direction()[a];
+                    negative[a] = inv_direction[a] < 0;
+                }
+            }
+
+            bool hit(const motion_node& node, interval ray_t) const {
+                for (int a = 0; a < 3; a++) {
+                    double lo = node.lower[0][a] + time * (node.lower[1][a] - node.lower[0][a]);
+                    double hi = node.upper[0][a] + time * (node.upper[1][a] - node.upper[0][a]);
+
+                    auto t0 = ((negative[a] ? hi : lo) - origin[a]) * inv_direction[a];
+                    auto t1 = ((negative[a] ? lo : hi) - origin[a]) * inv_direction[a];
+
+                    if (t0 > ray_t.min) ray_t.min = t0;
+                    if (t1 < ray_t.max) ray_t.max = t1;
+
+                    if (ray_t.max <= ray_t.min) return false;
+                }
+
+                return true;
+            }
+        };
+
+        static aabb node_box(const motion_node& node, int time) {
+            return aabb(interval(node.lower[time][0], node.upper[time][0]),
+                        interval(node.lower[time][1], node.upper[time][1]),
+                        interval(node.lower[time][2], node.upper[time][2]));
+        }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,147 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "framebuffer.h"
+#include "rtw_stb_image_write.h"
+
+#include <cstdio>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class output_sink {
+    public:
+        enum class format { ppm, png, hdr, pfm };
+
+        // Picks the format from the file extension (.ppm, .png, .hdr or .pfm). An empty name
+        // writes a binary PPM to stdout. Images of data rather than radiance pass gamma = false,
+        // so their 8-bit formats store the value itself.
+        output_sink(const std::string& _filename, bool _gamma = true)
+          : filename(_filename), fmt(format_for(_filename)), gamma(_gamma) {}
+
+        ~output_sink() { wait(); }
+
+        output_sink(const output_sink&) = delete;
+        output_sink& operator=(const output_sink&) = delete;
+
+        void begin(int _width, int _height) {
+            width = _width;
+            height = _height;
+
+            if (is_linear()) floats.assign(static_cast<size_t>(width) * height * 3, 0.0f);
+            else bytes.assign(static_cast<size_t>(width) * height * 3, 0);
+        }
+
+        void write_tile(const framebuffer& fb, int x0, int y0, int x1, int y1) {
+            // Converts a finished tile into the encoder's staging buffer. Workers call this as
+            // they finish tiles, so by the end of the render only the encoding itself is left.
+            for (int j = y0; j < y1; ++j) {
+                for (int i = x0; i < x1; ++i) {
+                    auto index = (static_cast<size_t>(j) * width + i) * 3;
+
+                    if (is_linear()) {
+                        // HDR and PFM keep linear radiance: no gamma, no clamp.
+                        auto c = fb.value(i, j);
+                        floats[index + 0] = static_cast<float>(c.x());
+                        floats[index + 1] = static_cast<float>(c.y());
+                        floats[index + 2] = static_cast<float>(c.z());
+                    } else {
+                        auto c = gamma ? adjust_color(fb.value(i, j)) : fb.value(i, j);
+                        bytes[index + 0] = color_byte(c.x());
+                        bytes[index + 1] = color_byte(c.y());
+                        bytes[index + 2] = color_byte(c.z());
+                    }
+                }
+            }
+        }
+
+        void finish() {
+            // Encodes and writes the image on a background thread.
+            pending = std::async(std::launch::async, [this] { return encode(); });
+        }
+
+        bool wait() {
+            // Blocks until the image is written. Returns false if writing it failed.
+            if (!pending.valid()) return true;
+            return pending.get();
+        }
+
+    private:
+        std::string filename;
+        format fmt;
+        bool gamma;
+        int width = 0;
+        int height = 0;
+        std::vector<unsigned char> bytes;
+        std::vector<float> floats;
+        std::future<bool> pending;
+
+        bool is_linear() const { return fmt == format::hdr || fmt == format::pfm; }
+
+        static format format_for(const std::string& name) {
+            auto dot = name.find_last_of('.');
+            auto ext = (dot == std::string::npos) ? std::string() : name.substr(dot + 1);
+
+            if (ext == "png") return format::png;
+            if (ext == "hdr") return format::hdr;
+            if (ext == "pfm") return format::pfm;
+            return format::ppm;
+        }
+
+        bool encode() {
+            bool ok = false;
+
+            switch (fmt) {
+                case format::png:
+                    ok = stbi_write_png(filename.c_str(), width, height, 3, bytes.data(), width * 3) != 0;
+                    break;
+                case format::hdr:
+                    ok = stbi_write_hdr(filename.c_str(), width, height, 3, floats.data()) != 0;
+                    break;
+                case format::pfm:
+                    ok = write_pfm();
+                    break;
+                case format::ppm:
+                    ok = write_ppm();
+                    break;
+            }
+
+            if (!ok) std::cerr << "ERROR: Could not write image file '" << filename << "'.\n";
+            return ok;
+        }
+
+        bool write_ppm() const {
+            // Binary (P6) PPM, to stdout when no file name was given.
+            auto file = filename.empty() ? stdout : std::fopen(filename.c_str(), "wb");
+            if (!file) return false;
+
+            std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+            auto ok = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+
+            if (file == stdout) std::fflush(file);
+            else ok = (std::fclose(file) == 0) && ok;
+            return ok;
+        }
+
+        bool write_pfm() const {
+            // Color PFM: little-endian floats (negative scale), rows stored bottom to top.
+            auto file = std::fopen(filename.c_str(), "wb");
+            if (!file) return false;
+
+            std::fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+
+            auto ok = true;
+            for (int j = height - 1; j >= 0; --j) {
+                auto row = floats.data() + static_cast<size_t>(j) * width * 3;
+                ok = ok && std::fwrite(row, sizeof(float), static_cast<size_t>(width) * 3, file) == static_cast<size_t>(width) * 3;
+            }
+
+            return (std::fclose(file) == 0) && ok;
+        }
+};
+
+#endif
\ No newline at end of file
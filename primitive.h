@@ -0,0 +1,73 @@
+#ifndef PRIMITIVE_H
+#define PRIMITIVE_H
+
+#include "rtweekend.h"
+#include "box.h"
+#include "constant_medium.h"
+#include "hittable.h"
+#include "quad.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <typeinfo>
+#include <vector>
+
+enum class primitive_kind : uint8_t { other, sphere, quad, box, instance, medium };
+
+struct primitive_ref {
+    // A BVH leaf's reference to one of its objects, tagged with the object's type when it is
+    // one of the closed set above. The leaf loops switch on the tag and call that type's own
+    // hit by name, which the compiler can inline, instead of going through the vtable on
+    // every object. Other types, subclasses of these included, are called virtually as before.
+    const hittable* object = nullptr;
+    primitive_kind kind = primitive_kind::other;
+
+    primitive_ref() = default;
+
+    primitive_ref(const hittable* p, bool devirtualize = true)
+      : object(p), kind(devirtualize ? kind_of(*p) : primitive_kind::other) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const {
+        switch (kind) {
+            case primitive_kind::sphere:   return static_cast<const sphere*>(object)->sphere::hit(r, ray_t, rec);
+            case primitive_kind::quad:     return static_cast<const quad*>(object)->quad::hit(r, ray_t, rec);
+            case primitive_kind::box:      return static_cast<const box*>(object)->box::hit(r, ray_t, rec);
+            case primitive_kind::instance: return static_cast<const instance*>(object)->instance::hit(r, ray_t, rec);
+            case primitive_kind::medium:   return static_cast<const constant_medium*>(object)->constant_medium::hit(r, ray_t, rec);
+            default:                       return object->hit(r, ray_t, rec);
+        }
+    }
+
+    bool occluded(const ray& r, interval ray_t) const {
+        switch (kind) {
+            case primitive_kind::sphere:   return static_cast<const sphere*>(object)->sphere::occluded(r, ray_t);
+            case primitive_kind::quad:     return static_cast<const quad*>(object)->quad::occluded(r, ray_t);
+            case primitive_kind::box:      return static_cast<const box*>(object)->box::occluded(r, ray_t);
+            case primitive_kind::instance: return static_cast<const instance*>(object)->instance::occluded(r, ray_t);
+            case primitive_kind::medium:   return static_cast<const constant_medium*>(object)->constant_medium::occluded(r, ray_t);
+            default:                       return object->occluded(r, ray_t);
+        }
+    }
+
+    static primitive_kind kind_of(const hittable& object) {
+        // Exact types only. translate and rotate_y add nothing but constructors to instance.
+        const auto& type = typeid(object);
+        if (type == typeid(sphere)) return primitive_kind::sphere;
+        if (type == typeid(quad)) return primitive_kind::quad;
+        if (type == typeid(box)) return primitive_kind::box;
+        if (type == typeid(instance) || type == typeid(translate) || type == typeid(rotate_y))
+            return primitive_kind::instance;
+        if (type == typeid(constant_medium)) return primitive_kind::medium;
+        return primitive_kind::other;
+    }
+};
+
+inline std::vector<primitive_ref> tag_primitives(const std::vector<shared_ptr<hittable>>& objects,
+                                                 bool devirtualize = true) {
+    std::vector<primitive_ref> refs;
+    refs.reserve(objects.size());
+    for (const auto& object : objects) refs.emplace_back(object.get(), devirtualize);
+    return refs;
+}
+
+#endif
\ No newline at end of file
@@ -3,7 +3,9 @@
 
 #include "rtweekend.h"
 #include "hittable.h"
-#include "hittable_list.h"
+#include "material.h"
+
+template <int W> class quad_batch;
 
 class quad : public hittable {
     public:
@@ -13,41 +15,97 @@ class quad : public hittable {
             normal = unit_vector(n);
             D = dot(normal, Q);
             w = n / dot(n,n);
+            area = n.length();
 
             set_bounding_box();
         }
 
         virtual void set_bounding_box() {
-            bbox = aabb(Q, Q + u + v).pad();
+            // Both diagonals, so a quad that is not axis-aligned is bounded too.
+            bbox = aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v)).pad();
         }
 
         aabb bounding_box() const override { return bbox; }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            auto denom = dot(normal, r.direction());
+            double t;
+            point3 intersection;
+            if (!plane_hit(r, ray_t, t, intersection, rec)) return false;
 
-            // No hit if the ray is parallel to the plane.
-            if (fabs(denom) < 1e-8) return false;
+            // Ray hits the 2D shape; is_interior has set the texture coordinates, and the rest
+            // waits for finalize_hit.
+            rec.t = t;
+            rec.object = this;
+            return true;
+        }
 
-            // Return false if the hit point parameter t is outside the ray interval
-            auto t = (D - dot(normal, r.origin())) / denom;
-            if (!ray_t.contains(t)) return false;
+        void finalize_hit(const ray& r, hit_record& rec) const override {
+            set_hit_record(r, rec.t, r.at(rec.t), rec);
+        }
 
-            // Determine the hit point lies within the planar shape using its plane coordinates.
-            auto intersection = r.at(t);
-            vec3 planar_hitpt_vector = intersection - Q;
-            auto alpha = dot(w, cross(planar_hitpt_vector, v));
-            auto beta = dot(w, cross(u, planar_hitpt_vector));
+        bool occluded(const ray& r, interval ray_t) const override {
+            // is_interior also writes the texture coordinates; they go to a scratch record.
+            double t;
+            point3 intersection;
+            hit_record rec;
+            return plane_hit(r, ray_t, t, intersection, rec);
+        }
 
-            if (!is_interior(alpha, beta, rec)) return false;
+        double pdf_value(const point3& origin, const vec3& direction) const override {
+            hit_record rec;
+            if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec)) return 0;
 
-            // Ray hits the 2D shape; set the rest of the hit record and return true
-            rec.t = t;
-            rec.p = intersection;
-            rec.mat = mat;
-            rec.set_face_normal(r, normal);
+            auto distance_squared = rec.t * rec.t * direction.length_squared();
+            auto cosine = fabs(dot(direction, normal) / direction.length());
 
-            return true;
+            return distance_squared / (cosine * area);
+        }
+
+        vec3 random(const point3& origin, sampler& s) const override {
+            auto p = s.get_2d();
+            return (Q + (p.x * u) + (p.y * v)) - origin;
+        }
+
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            if (mat->is_emitter()) lights.push_back(this);
+        }
+
+        aabb clip_box(const aabb& region) const override {
+            // Clips the parallelogram to each of the region's six planes in turn (Sutherland-
+            // Hodgman) and bounds what is left. Each plane adds at most one vertex. An axis-aligned
+            // quad fills its box's face, so the overlap of the boxes is already exact.
+            if ((normal[0] == 0) + (normal[1] == 0) + (normal[2] == 0) == 2) return intersection(bbox, region);
+
+            point3 polygon[10] = { Q, Q + u, Q + u + v, Q + v };
+            point3 clipped[10];
+            int n = 4;
+
+            for (int a = 0; a < 3 && n > 0; a++) {
+                for (int side = 0; side < 2 && n > 0; side++) {
+                    auto plane = side ? region.axis(a).max : region.axis(a).min;
+                    auto inside = [&](const point3& p) { return side ? p[a] <= plane : p[a] >= plane; };
+
+                    int m = 0;
+                    for (int i = 0; i < n; i++) {
+                        const auto& p = polygon[i];
+                        const auto& q = polygon[(i + 1) % n];
+
+                        if (inside(p)) clipped[m++] = p;
+                        if (inside(p) != inside(q)) {
+                            auto crossing = p + (plane - p[a]) / (q[a] - p[a]) * (q - p);
+                            crossing[a] = plane;
+                            clipped[m++] = crossing;
+                        }
+                    }
+
+                    std::copy(clipped, clipped + m, polygon);
+                    n = m;
+                }
+            }
+
+            aabb box;
+            for (int i = 0; i < n; i++) box = aabb(box, aabb(polygon[i], polygon[i]));
+            return n > 0 ? box.pad() : box;
         }
 
         virtual bool is_interior(double a, double b, hit_record& rec) const {
@@ -60,6 +118,8 @@ class quad : public hittable {
         }
     
     private:
+        template <int W> friend class quad_batch;
+
         point3 Q;
         vec3 u, v;
         shared_ptr<material> mat;
@@ -67,28 +127,35 @@ class quad : public hittable {
         vec3 normal;
         double D;
         vec3 w;
-};
+        double area;
 
-inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat) {
-    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
-    auto sides = make_shared<hittable_list>();
+        void set_hit_record(const ray& r, double t, const point3& intersection, hit_record& rec) const {
+            // Everything but the texture coordinates, which is_interior has set.
+            rec.t = t;
+            rec.p = intersection;
+            rec.mat = mat.get();
+            rec.object = this;
+            rec.set_face_normal(r, normal);
+        }
 
-    // Construct the two opoosite vertices with the minimum and maximum coordinates.
-    auto min = point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
-    auto max = point3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z()));
+        bool plane_hit(const ray& r, interval ray_t, double& t, point3& intersection, hit_record& rec) const {
+            auto denom = dot(normal, r.direction());
 
-    auto dx = vec3(max.x() - min.x(), 0, 0);
-    auto dy = vec3(0, max.y() - min.y(), 0);
-    auto dz = vec3(0, 0, max.z() - min.z());
+            // No hit if the ray is parallel to the plane.
+            if (fabs(denom) < 1e-8) return false;
 
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()), dx, dy, mat)); // front
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()),-dz, dy, mat)); // right
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()),-dx, dy, mat)); // back
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dz, dy, mat)); // left
-    sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()), dx,-dz, mat)); // top
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dx, dz, mat)); // bottom
+            // Return false if the hit point parameter t is outside the ray interval
+            t = (D - dot(normal, r.origin())) / denom;
+            if (!ray_t.contains(t)) return false;
+
+            // Determine the hit point lies within the planar shape using its plane coordinates.
+            intersection = r.at(t);
+            vec3 planar_hitpt_vector = intersection - Q;
+            auto alpha = dot(w, cross(planar_hitpt_vector, v));
+            auto beta = dot(w, cross(u, planar_hitpt_vector));
 
-    return sides;
-}
+            return is_interior(alpha, beta, rec);
+        }
+};
 
 #endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+inline uint64_t mix_bits(uint64_t v) {
+    // SplitMix64 finalizer: scrambles a counter or key into well-distributed 64-bit output.
+    v += 0x9e3779b97f4a7c15ull;
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ull;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebull;
+    return v ^ (v >> 31);
+}
+
+class pcg32 {
+    public:
+        // PCG-XSH-RR with 64 bits of state. Each (seed, stream) pair selects an independent
+        // sequence, so a generator can be derived from a pixel index instead of being shared.
+        pcg32() : pcg32(0, 0) {}
+
+        pcg32(uint64_t seed, uint64_t stream) {
+            state = 0;
+            inc = (stream << 1) | 1;
+            next_uint();
+            state += mix_bits(seed ^ mix_bits(stream));
+            next_uint();
+        }
+
+        uint32_t next_uint() {
+            auto old_state = state;
+            state = old_state * 6364136223846793005ull + inc;
+            auto xorshifted = static_cast<uint32_t>(((old_state >> 18) ^ old_state) >> 27);
+            auto rot = static_cast<uint32_t>(old_state >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((~rot + 1) & 31));
+        }
+
+        double next_double() {
+            // Returns a random real in [0,1).
+            return next_uint() * (1.0 / 4294967296.0);
+        }
+
+    private:
+        uint64_t state;
+        uint64_t inc;
+};
+
+#endif
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <limits>
 #include <memory>
 
+#include "rng.h"
+
 // Usings
 using std::shared_ptr;
 using std::make_shared;
@@ -21,8 +23,10 @@ inline double degrees_to_radians(double degrees) {
 }
 
 inline double random_double() {
-    // Returns a random real in [0,1].
-    return rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1). Each thread draws from its own generator, so this is
+    // safe but not reproducible across threads; rendering uses a per-pixel sampler instead.
+    thread_local pcg32 rng;
+    return rng.next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,343 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <cstring>
+#include <memory>
+
+struct point2 {
+    double x, y;
+};
+
+class sampler {
+    public:
+        // A per-pixel source of sample values. The camera calls start_sample before each sample
+        // of the pixel; after that every get_1d/get_2d call consumes the next dimension (pixel
+        // position, lens, time, then each bounce's scattering decisions). Implementations
+        // spread the values of each dimension evenly across the pixel's samples.
+        //
+        // random_double is a plain random stream for the things that do not fit a fixed
+        // dimension, such as rejection sampling. It is seeded from the same key, so an image
+        // is bit-identical for a given seed however many threads render it.
+        sampler(uint64_t _key) : rng(_key, 0), key(_key) {}
+
+        virtual ~sampler() = default;
+
+        void start_pixel(uint64_t _key) {
+            // Re-keys the sampler for another pixel. It then draws exactly what a sampler
+            // constructed with that key would, so one sampler can serve a whole tile.
+            rng = pcg32(_key, 0);
+            key = _key;
+            sample_index = 0;
+            dimension = 0;
+        }
+
+        virtual void start_sample(int index) {
+            sample_index = index;
+            dimension = 0;
+        }
+
+        virtual double get_1d() = 0;
+        virtual point2 get_2d() = 0;
+
+        double random_double() {
+            // Returns a random real in [0,1).
+            return rng.next_double();
+        }
+
+        double random_double(double min, double max) {
+            // Returns a random real in [min,max).
+            return min + (max-min) * random_double();
+        }
+
+    protected:
+        pcg32 rng;
+        uint64_t key;
+        int sample_index = 0;
+        int dimension = 0;
+
+        uint64_t dimension_key() const { return mix_bits(key ^ mix_bits(static_cast<uint64_t>(dimension))); }
+
+        static double to_unit(uint32_t bits) {
+            // Maps 32 bits to [0,1), never rounding up to 1.
+            return bits * (1.0 / 4294967296.0);
+        }
+};
+
+class independent_sampler : public sampler {
+    public:
+        // Every value is an independent uniform sample.
+        independent_sampler(uint64_t key) : sampler(key) {}
+
+        // A stream keyed on the ray itself, for code (such as constant_medium::hit) that is
+        // reached through the hittable interface and has no sampler of its own.
+        independent_sampler(const ray& r) : sampler(ray_key(r)) {}
+
+        double get_1d() override { return random_double(); }
+
+        point2 get_2d() override {
+            auto x = random_double();
+            auto y = random_double();
+            return { x, y };
+        }
+
+    private:
+        static uint64_t ray_key(const ray& r) {
+            double fields[7] = {
+                r.origin().x(), r.origin().y(), r.origin().z(),
+                r.direction().x(), r.direction().y(), r.direction().z(),
+                r.time()
+            };
+
+            uint64_t key = 0;
+            for (double f : fields) {
+                uint64_t bits;
+                std::memcpy(&bits, &f, sizeof(bits));
+                key = mix_bits(key ^ bits);
+            }
+
+            return key;
+        }
+};
+
+class stratified_sampler : public sampler {
+    public:
+        // Jittered strata: for each dimension the pixel's samples fall one per stratum (a
+        // sqrt(spp) by sqrt(spp) grid in 2D), with the strata visited in a different random
+        // order per dimension. Samples past the last stratum are independent.
+        stratified_sampler(uint64_t key, int samples_per_pixel)
+         : sampler(key), spp(samples_per_pixel < 1 ? 1 : samples_per_pixel) {
+            sqrt_spp = static_cast<int>(sqrt(spp));
+            if (sqrt_spp < 1) sqrt_spp = 1;
+        }
+
+        double get_1d() override {
+            auto seed = static_cast<uint32_t>(dimension_key());
+            dimension++;
+
+            if (sample_index >= spp) return random_double();
+            auto stratum = permutation_element(static_cast<uint32_t>(sample_index), spp, seed);
+            return (stratum + random_double()) / spp;
+        }
+
+        point2 get_2d() override {
+            auto seed = static_cast<uint32_t>(dimension_key());
+            dimension += 2;
+
+            auto strata = sqrt_spp * sqrt_spp;
+            if (sample_index >= strata) return { random_double(), random_double() };
+
+            auto stratum = static_cast<int>(permutation_element(static_cast<uint32_t>(sample_index), strata, seed));
+            auto x = (stratum % sqrt_spp + random_double()) / sqrt_spp;
+            auto y = (stratum / sqrt_spp + random_double()) / sqrt_spp;
+            return { x, y };
+        }
+
+    private:
+        int spp;
+        int sqrt_spp;
+
+        static uint32_t permutation_element(uint32_t i, uint32_t l, uint32_t p) {
+            // Element i of a pseudo-random permutation of [0,l) selected by p (Kensler 2013).
+            uint32_t w = l - 1;
+            w |= w >> 1;
+            w |= w >> 2;
+            w |= w >> 4;
+            w |= w >> 8;
+            w |= w >> 16;
+
+            do {
+                i ^= p;             i *= 0xe170893d;
+                i ^= p >> 16;
+                i ^= (i & w) >> 4;
+                i ^= p >> 8;        i *= 0x0929eb3f;
+                i ^= p >> 23;
+                i ^= (i & w) >> 1;  i *= 1 | p >> 27;
+                                    i *= 0x6935fa69;
+                i ^= (i & w) >> 11; i *= 0x74dcb303;
+                i ^= (i & w) >> 2;  i *= 0x9e501cc3;
+                i ^= (i & w) >> 2;  i *= 0xc860a3df;
+                i &= w;
+                i ^= i >> 5;
+            } while (i >= l);
+
+            return (i + p) % l;
+        }
+};
+
+class halton_sampler : public sampler {
+    public:
+        // The Halton sequence over the pixel's sample index, one prime base per dimension,
+        // with a per-pixel random toroidal shift (Cranley-Patterson rotation) so neighbouring
+        // pixels do not repeat each other. Dimensions past the prime table are independent.
+        halton_sampler(uint64_t key) : sampler(key) {}
+
+        double get_1d() override { return next_dimension(); }
+
+        point2 get_2d() override {
+            auto x = next_dimension();
+            auto y = next_dimension();
+            return { x, y };
+        }
+
+    private:
+        static constexpr int prime_count = 32;
+
+        double next_dimension() {
+            static const int primes[prime_count] = {
+                  2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+                 59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131
+            };
+
+            auto shift = to_unit(static_cast<uint32_t>(dimension_key() >> 32));
+            auto d = dimension++;
+            if (d >= prime_count) return random_double();
+
+            auto value = radical_inverse(primes[d], static_cast<uint64_t>(sample_index)) + shift;
+            return (value >= 1) ? value - 1 : value;
+        }
+
+        static double radical_inverse(int base, uint64_t index) {
+            auto inv_base = 1.0 / base;
+            auto inv_base_n = 1.0;
+            uint64_t reversed = 0;
+
+            while (index) {
+                auto next = index / base;
+                auto digit = index - next * base;
+                reversed = reversed * base + digit;
+                inv_base_n *= inv_base;
+                index = next;
+            }
+
+            return std::fmin(reversed * inv_base_n, 0x1.fffffffffffffp-1);
+        }
+};
+
+class sobol_sampler : public sampler {
+    public:
+        // Owen-scrambled Sobol points (Burley 2020). Each 2D request takes the first two Sobol
+        // dimensions, with the sample index shuffled and each axis scrambled by a hash seeded
+        // from the pixel and dimension. That keeps every pair of dimensions well stratified
+        // without needing direction numbers for deep paths.
+        sobol_sampler(uint64_t key) : sampler(key) {}
+
+        double get_1d() override {
+            auto seed = dimension_key();
+            dimension++;
+
+            auto index = shuffled_index(seed);
+            return to_unit(nested_uniform_scramble(reverse_bits(index), static_cast<uint32_t>(seed >> 32)));
+        }
+
+        point2 get_2d() override {
+            auto seed = dimension_key();
+            dimension += 2;
+
+            auto index = shuffled_index(seed);
+            auto x = nested_uniform_scramble(reverse_bits(index), static_cast<uint32_t>(seed >> 32));
+            auto y = nested_uniform_scramble(sobol_dimension_1(index), static_cast<uint32_t>(mix_bits(seed) >> 32));
+            return { to_unit(x), to_unit(y) };
+        }
+
+    private:
+        uint32_t shuffled_index(uint64_t seed) const {
+            return nested_uniform_scramble(static_cast<uint32_t>(sample_index), static_cast<uint32_t>(seed));
+        }
+
+        static uint32_t sobol_dimension_1(uint32_t index) {
+            uint32_t result = 0;
+            for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+                if (index & 1) result ^= v;
+            return result;
+        }
+
+        static uint32_t reverse_bits(uint32_t x) {
+            x = (x << 16) | (x >> 16);
+            x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+            x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+            x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+            x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+            return x;
+        }
+
+        static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+            x += seed;
+            x ^= x * 0x6c50b47cu;
+            x ^= x * 0xb82f1e52u;
+            x ^= x * 0xc7afe638u;
+            x ^= x * 0x8d22f6e6u;
+            return x;
+        }
+
+        static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+            x = reverse_bits(x);
+            x = laine_karras_permutation(x, seed);
+            return reverse_bits(x);
+        }
+};
+
+enum class sampling { independent, stratified, halton, sobol };
+
+inline std::unique_ptr<sampler> make_sampler(sampling kind, uint64_t key, int samples_per_pixel) {
+    switch (kind) {
+        case sampling::stratified: return std::make_unique<stratified_sampler>(key, samples_per_pixel);
+        case sampling::halton:     return std::make_unique<halton_sampler>(key);
+        case sampling::sobol:      return std::make_unique<sobol_sampler>(key);
+        default:                   return std::make_unique<independent_sampler>(key);
+    }
+}
+
+// Sampler versions of the vec3 random utilities
+
+inline vec3 random_in_unit_sphere(sampler& s) {
+    while (true) {
+        auto p = vec3(s.random_double(-1,1), s.random_double(-1,1), s.random_double(-1,1));
+        if (p.length_squared() < 1) return p;
+    }
+}
+
+inline vec3 random_unit_vector(sampler& s) {
+    // Maps one 2D sample uniformly onto the sphere.
+    auto u = s.get_2d();
+    auto z = 1 - 2 * u.x;
+    auto r = sqrt(fmax(0.0, 1 - z*z));
+    auto phi = 2 * pi * u.y;
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+inline vec3 random_in_unit_disk(sampler& s) {
+    // Maps one 2D sample onto the unit disk with Shirley's concentric mapping, which keeps
+    // the sample's stratification.
+    auto u = s.get_2d();
+    auto a = 2 * u.x - 1;
+    auto b = 2 * u.y - 1;
+    if (a == 0 && b == 0) return vec3(0, 0, 0);
+
+    double r, theta;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = (pi / 2) - (pi / 4) * (a / b);
+    }
+
+    return vec3(r * cos(theta), r * sin(theta), 0);
+}
+
+inline vec3 random_cosine_direction(sampler& s) {
+    auto u = s.get_2d();
+    auto r1 = u.x;
+    auto r2 = u.y;
+
+    auto phi = 2 * pi * r1;
+    auto x = cos(phi) * sqrt(r2);
+    auto y = sin(phi) * sqrt(r2);
+    auto z = sqrt(1 - r2);
+
+    return vec3(x, y, z);
+}
+
+#endif
\ No newline at end of file
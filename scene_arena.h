@@ -0,0 +1,95 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A pointer to an object in a scene_arena. It is a shared_ptr, so it goes wherever a scene takes
+// one, but it owns nothing: it has no control block, copies touch no reference count, and the
+// object lives exactly as long as its arena, however many arena_ptrs still point at it.
+template <typename T>
+using arena_ptr = shared_ptr<T>;
+
+class scene_arena {
+    public:
+        // Owns a scene's objects. make<T> constructs one in the arena's current block, next to
+        // the objects made before it. Everything goes when the arena does, so it must outlive
+        // every use of the scene, as it does when it is declared first in a scene function.
+        //
+        // The arena saves the allocation, the free and the reference counting of each object,
+        // not the teardown: destroying it runs every non-trivial destructor, in the reverse
+        // order of construction, so it is O(n) in the objects made. Objects a constructor makes
+        // for itself with make_shared (lambertian(color)'s solid_color, say) are not in the
+        // arena; pass it arena-made parts instead.
+        scene_arena() = default;
+        scene_arena(const scene_arena&) = delete;
+        scene_arena& operator=(const scene_arena&) = delete;
+
+        ~scene_arena() {
+            for (auto c = cleanups.rbegin(); c != cleanups.rend(); ++c) c->destroy(c->object);
+        }
+
+        template <typename T, typename... Args>
+        arena_ptr<T> make(Args&&... args) {
+            static_assert(alignof(T) <= block_alignment, "arena objects are aligned to at most a cache line");
+
+            T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            if (!std::is_trivially_destructible<T>::value)
+                cleanups.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+            objects++;
+
+            return arena_ptr<T>(shared_ptr<T>(), object);
+        }
+
+        size_t object_count() const { return objects; }
+        size_t bytes_used() const { return used; }
+
+    private:
+        static constexpr size_t block_size = 64 * 1024;
+        static constexpr size_t block_alignment = 64;
+
+        struct block_deleter {
+            void operator()(std::byte* p) const { ::operator delete(p, std::align_val_t(block_alignment)); }
+        };
+
+        struct cleanup {
+            void* object;
+            void (*destroy)(void*);
+        };
+
+        std::vector<std::unique_ptr<std::byte, block_deleter>> blocks;
+        std::byte* cursor = nullptr;
+        size_t remaining = 0;
+        std::vector<cleanup> cleanups;
+        size_t objects = 0;
+        size_t used = 0;
+
+        void* allocate(size_t size, size_t alignment) {
+            auto padding = (alignment - reinterpret_cast<uintptr_t>(cursor) % alignment) % alignment;
+
+            if (!cursor || padding + size > remaining) {
+                // An object larger than a block gets a block of its own.
+                auto bytes = std::max(size, block_size);
+                blocks.emplace_back(static_cast<std::byte*>(::operator new(bytes, std::align_val_t(block_alignment))));
+                cursor = blocks.back().get();
+                remaining = bytes;
+                padding = 0;
+            }
+
+            auto p = cursor + padding;
+            cursor = p + size;
+            remaining -= padding + size;
+            used += size;
+            return p;
+        }
+};
+
+#endif
\ No newline at end of file
@@ -2,6 +2,10 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
+
+template <int W> class sphere_batch;
 
 class sphere : public hittable {
     public:
@@ -25,6 +29,89 @@ class sphere : public hittable {
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
             point3 center = is_moving ? sphere_center(r.time()) : center1;
+            double root;
+            if (!nearest_root(r, center, ray_t, root)) return false;
+
+            rec.t = root;
+            rec.object = this;
+            return true;
+        }
+
+        void finalize_hit(const ray& r, hit_record& rec) const override {
+            point3 center = is_moving ? sphere_center(r.time()) : center1;
+            set_hit_record(r, center, rec.t, rec);
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            point3 center = is_moving ? sphere_center(r.time()) : center1;
+            double root;
+            return nearest_root(r, center, ray_t, root);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        aabb clip_box(const aabb& region) const override { return intersection(bbox, region); }
+
+        void motion_bounds(aabb& start, aabb& end) const override {
+            auto rvec = vec3(radius, radius, radius);
+            start = aabb(center1 - rvec, center1 + rvec);
+            end = aabb(sphere_center(1) - rvec, sphere_center(1) + rvec);
+        }
+
+        double pdf_value(const point3& origin, const vec3& direction) const override {
+            // This method only works for stationary spheres.
+            if (!this->occluded(ray(origin, direction), interval(0.001, infinity))) return 0;
+
+            auto distance_squared = (center1 - origin).length_squared();
+            if (distance_squared <= radius*radius) return 1 / (4*pi);
+
+            auto cos_theta_max = sqrt(1 - radius*radius / distance_squared);
+            auto solid_angle = 2*pi*(1-cos_theta_max);
+
+            return 1 / solid_angle;
+        }
+
+        vec3 random(const point3& origin, sampler& s) const override {
+            // Samples the cone of directions subtended by the sphere, or every direction when
+            // origin is inside it.
+            vec3 direction = center1 - origin;
+            auto distance_squared = direction.length_squared();
+            if (distance_squared <= radius*radius) return random_unit_vector(s);
+
+            onb uvw;
+            uvw.build_from_w(direction);
+            return uvw.local(random_to_sphere(radius, distance_squared, s));
+        }
+
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            if (!is_moving && radius > 0 && mat->is_emitter()) lights.push_back(this);
+        }
+    
+    private:
+        template <int W> friend class sphere_batch;
+
+        point3 center1;
+        double radius;
+        shared_ptr<material> mat;
+        bool is_moving;
+        vec3 center_vec;
+        aabb bbox;
+
+        point3 sphere_center(double time) const {
+            return center1 + time * center_vec;
+        }
+
+        void set_hit_record(const ray& r, const point3& center, double root, hit_record& rec) const {
+            rec.t = root;
+            rec.p = r.at(rec.t);
+            vec3 outward_normal = (rec.p - center) / radius;
+            rec.set_face_normal(r, outward_normal);
+            get_sphere_uv(outward_normal, rec.u, rec.v);
+            rec.mat = mat.get();
+            rec.object = this;
+        }
+
+        bool nearest_root(const ray& r, const point3& center, interval ray_t, double& root) const {
             vec3 oc = r.origin() - center;
             auto a = r.direction().length_squared();
             auto half_b = dot(oc, r.direction());
@@ -35,7 +122,7 @@ class sphere : public hittable {
             auto sqrtd = sqrt(discriminant);
 
             // Find the nearest root that lies in the acceptable range
-            auto root = (-half_b - sqrtd) / a;
+            root = (-half_b - sqrtd) / a;
 
             if (!ray_t.surrounds(root)) {
                 root = (-half_b + sqrtd) / a;
@@ -44,29 +131,8 @@ class sphere : public hittable {
                 }
             }
 
-            rec.t = root;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            get_sphere_uv(outward_normal, rec.u, rec.v);
-            rec.mat = mat;
-
             return true;
         }
-
-        aabb bounding_box() const override { return bbox; }
-    
-    private:
-        point3 center1;
-        double radius;
-        shared_ptr<material> mat;
-        bool is_moving;
-        vec3 center_vec;
-        aabb bbox;
-
-        point3 sphere_center(double time) const {
-            return center1 + time * center_vec;
-        }
         
         static void get_sphere_uv(const point3& p, double& u, double& v) {
             auto theta = acos(-p.y());
@@ -75,6 +141,19 @@ class sphere : public hittable {
             u = phi / (2 * pi);
             v = theta / pi;
         }
+
+        static vec3 random_to_sphere(double radius, double distance_squared, sampler& s) {
+            auto u = s.get_2d();
+            auto r1 = u.x;
+            auto r2 = u.y;
+            auto z = 1 + r2*(sqrt(1-radius*radius/distance_squared) - 1);
+
+            auto phi = 2*pi*r1;
+            auto x = cos(phi)*sqrt(1-z*z);
+            auto y = sin(phi)*sqrt(1-z*z);
+
+            return vec3(x, y, z);
+        }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,150 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool {
+    public:
+        // A pool of n_threads workers (0 = one per hardware thread). The thread that calls
+        // parallel_for takes part as worker 0, so only n_threads - 1 threads are spawned.
+        thread_pool(int n_threads = 0) {
+            if (n_threads <= 0) n_threads = static_cast<int>(std::thread::hardware_concurrency());
+            if (n_threads <= 0) n_threads = 1;
+
+            for (int i = 0; i < n_threads; i++) queues.push_back(std::make_unique<work_queue>());
+            for (int i = 1; i < n_threads; i++) workers.emplace_back([this, i] { worker_loop(i); });
+        }
+
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> lock(pool_mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+
+            for (auto& worker : workers) worker.join();
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        int size() const { return static_cast<int>(queues.size()); }
+
+        template <typename F>
+        void parallel_for(size_t count, F&& task) {
+            // Runs task(index, worker) for every index in [0, count) and returns when all of them
+            // have finished. The indices are dealt out to the workers in contiguous blocks, so
+            // neighbouring tasks start on the same thread. A worker that drains its own queue
+            // steals from the back of the others', taking the work farthest from their owners.
+            if (count == 0) return;
+
+            std::function<void(size_t, int)> body = std::forward<F>(task);
+            auto n = queues.size();
+
+            {
+                std::lock_guard<std::mutex> lock(pool_mutex);
+                job = &body;
+                pending = count;
+
+                for (size_t w = 0; w < n; w++) {
+                    std::lock_guard<std::mutex> queue_lock(queues[w]->mutex);
+                    for (size_t i = count * w / n; i < count * (w + 1) / n; i++)
+                        queues[w]->tasks.push_back(i);
+                }
+
+                generation++;
+            }
+            wake.notify_all();
+
+            run_tasks(0);
+
+            std::unique_lock<std::mutex> lock(pool_mutex);
+            done.wait(lock, [this] { return pending == 0; });
+            job = nullptr;
+        }
+
+    private:
+        struct work_queue {
+            std::mutex mutex;
+            std::deque<size_t> tasks;
+        };
+
+        std::vector<std::unique_ptr<work_queue>> queues;
+        std::vector<std::thread> workers;
+
+        std::mutex pool_mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        std::function<void(size_t, int)>* job = nullptr;
+        size_t pending = 0;
+        unsigned long generation = 0;
+        bool stopping = false;
+
+        void worker_loop(int worker) {
+            unsigned long seen = 0;
+
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(pool_mutex);
+                    wake.wait(lock, [&] { return stopping || generation != seen; });
+                    if (stopping) return;
+                    seen = generation;
+                }
+
+                run_tasks(worker);
+            }
+        }
+
+        bool pop_local(int worker, size_t& task) {
+            auto& queue = *queues[worker];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) return false;
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+            return true;
+        }
+
+        bool steal(int worker, size_t& task) {
+            auto n = static_cast<int>(queues.size());
+
+            for (int k = 1; k < n; k++) {
+                auto& victim = *queues[(worker + k) % n];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.tasks.empty()) continue;
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+
+            return false;
+        }
+
+        void run_tasks(int worker) {
+            size_t task;
+
+            while (pop_local(worker, task) || steal(worker, task)) {
+                (*job)(task, worker);
+
+                std::lock_guard<std::mutex> lock(pool_mutex);
+                if (--pending == 0) done.notify_all();
+            }
+        }
+};
+
+inline thread_pool& shared_thread_pool() {
+    // One pool, with a worker per hardware thread, for everything in the program that does not
+    // ask for a particular thread count, so scene building and rendering share workers.
+    static thread_pool pool;
+    return pool;
+}
+
+#endif
\ No newline at end of file
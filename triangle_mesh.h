@@ -0,0 +1,725 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct mesh_arrays {
+    // A mesh's vertex attributes, one array per component, and its triangles as three vertex
+    // indices each. The normal and texture coordinate arrays are either empty or as long as
+    // the position arrays.
+    std::vector<float> x, y, z;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> u, v;
+    std::vector<uint32_t> indices;
+
+    size_t vertex_count() const { return x.size(); }
+    size_t triangle_count() const { return indices.size() / 3; }
+};
+
+class triangle_mesh : public hittable {
+    public:
+        // Triangles sharing their vertices, with a BVH of their own over triangle indices, so
+        // a mesh is one object to the scene's BVH however many triangles it has. The triangles
+        // are stored in the order the leaves reference them, so a leaf is a range of them.
+        triangle_mesh(mesh_arrays data, shared_ptr<material> m) : mesh(std::move(data)), mat(m) {
+            build();
+        }
+
+        triangle_mesh(const char* filename, shared_ptr<material> m) : mat(m) {
+            // Loads a Wavefront OBJ or binary PLY file, chosen by the file's extension. If it
+            // could not be loaded, the mesh is empty.
+            auto name = std::string(filename);
+            auto extension = name.substr(std::min(name.size(), name.find_last_of('.') + 1));
+            for (auto& c : extension) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+
+            std::string text;
+            bool loaded = false;
+            if (read_file(name, text)) {
+                if (extension == "obj") loaded = parse_obj(text, mesh);
+                else if (extension == "ply") loaded = parse_ply(text, mesh);
+            }
+
+            if (!loaded) {
+                std::cerr << "ERROR: Could not load mesh file '" << filename << "'.\n";
+                mesh = mesh_arrays();
+            }
+
+            build();
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (nodes.empty()) return false;
+
+            bvh_node::ray_slopes slopes(r);
+            watertight_ray wr(r);
+            uint32_t stack[max_depth];
+            int top = 0;
+            uint32_t index = 0;
+            uint32_t closest = 0;
+            double b1 = 0, b2 = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                const auto& node = nodes[index];
+
+                if (slopes.hit(node, ray_t)) {
+                    if (node.count > 0) {
+                        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                            double t, u, v;
+                            if (intersect(i, wr, ray_t, t, u, v)) {
+                                hit_anything = true;
+                                closest = i;
+                                ray_t.max = t;
+                                b1 = u;
+                                b2 = v;
+                            }
+                        }
+                    } else {
+                        if (slopes.negative[node.axis]) {
+                            stack[top++] = index + 1;
+                            index = node.offset;
+                        } else {
+                            stack[top++] = node.offset;
+                            index = index + 1;
+                        }
+                        continue;
+                    }
+                }
+
+                if (top == 0) break;
+                index = stack[--top];
+            }
+
+            if (!hit_anything) return false;
+
+            // The barycentrics wait in u and v for finalize_hit.
+            rec.t = ray_t.max;
+            rec.object = this;
+            rec.primitive = closest;
+            rec.u = b1;
+            rec.v = b2;
+            return true;
+        }
+
+        void finalize_hit(const ray& r, hit_record& rec) const override {
+            set_hit(rec.primitive, r, rec.u, rec.v, rec);
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            bvh_node::ray_slopes slopes(r);
+            watertight_ray wr(r);
+            uint32_t stack[max_depth];
+            int top = 0;
+            uint32_t index = 0;
+
+            while (true) {
+                const auto& node = nodes[index];
+
+                if (slopes.hit(node, ray_t)) {
+                    if (node.count > 0) {
+                        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                            double t, b1, b2;
+                            if (intersect(i, wr, ray_t, t, b1, b2)) return true;
+                        }
+                    } else {
+                        stack[top++] = node.offset;
+                        index = index + 1;
+                        continue;
+                    }
+                }
+
+                if (top == 0) break;
+                index = stack[--top];
+            }
+
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        size_t vertex_count() const { return mesh.vertex_count(); }
+        size_t triangle_count() const { return mesh.triangle_count(); }
+        size_t node_bytes() const { return nodes.size() * sizeof(bvh_node::linear_node); }
+
+        size_t vertex_bytes() const {
+            return (mesh.x.size() + mesh.y.size() + mesh.z.size() + mesh.nx.size() + mesh.ny.size()
+                    + mesh.nz.size() + mesh.u.size() + mesh.v.size()) * sizeof(float)
+                   + mesh.indices.size() * sizeof(uint32_t);
+        }
+
+    private:
+        static constexpr int max_depth = 64;
+
+        mesh_arrays mesh;
+        shared_ptr<material> mat;
+        std::vector<bvh_node::linear_node> nodes;
+        aabb bbox;
+
+        struct watertight_ray {
+            // Watertight ray-triangle intersection (Woop, Benthin and Wald 2013). The vertices
+            // are moved into a space where the ray runs from the origin along +z, and the
+            // triangle is tested in 2D with edge functions. An edge shared by two triangles
+            // gives both the same edge function up to sign, so a ray through the edge hits
+            // one of them: there are no cracks between triangles for rays to slip through.
+            double origin[3];
+            int kx, ky, kz;
+            double sx, sy, sz;
+
+            watertight_ray(const ray& r) {
+                auto d = r.direction();
+                for (int a = 0; a < 3; a++) origin[a] = r.origin()[a];
+
+                kz = (fabs(d[0]) > fabs(d[1])) ? (fabs(d[0]) > fabs(d[2]) ? 0 : 2)
+                                               : (fabs(d[1]) > fabs(d[2]) ? 1 : 2);
+                kx = (kz + 1) % 3;
+                ky = (kx + 1) % 3;
+                if (d[kz] < 0) std::swap(kx, ky);   // Keeps the winding
+
+                sx = d[kx] / d[kz];
+                sy = d[ky] / d[kz];
+                sz = 1.0 / d[kz];
+            }
+        };
+
+        bool intersect(uint32_t triangle, const watertight_ray& wr, const interval& ray_t,
+                       double& t, double& b1, double& b2) const {
+            const auto* tri = &mesh.indices[3 * triangle];
+            double a[3], b[3], c[3];
+            vertex_offset(tri[0], wr, a);
+            vertex_offset(tri[1], wr, b);
+            vertex_offset(tri[2], wr, c);
+
+            auto ax = a[wr.kx] - wr.sx * a[wr.kz];
+            auto ay = a[wr.ky] - wr.sy * a[wr.kz];
+            auto bx = b[wr.kx] - wr.sx * b[wr.kz];
+            auto by = b[wr.ky] - wr.sy * b[wr.kz];
+            auto cx = c[wr.kx] - wr.sx * c[wr.kz];
+            auto cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+            // Each edge function is the weight of the vertex opposite its edge.
+            auto e0 = cx * by - cy * bx;
+            auto e1 = ax * cy - ay * cx;
+            auto e2 = bx * ay - by * ax;
+
+            if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) return false;
+
+            auto det = e0 + e1 + e2;
+            if (det == 0) return false;
+
+            auto scaled = e0 * wr.sz * a[wr.kz] + e1 * wr.sz * b[wr.kz] + e2 * wr.sz * c[wr.kz];
+            t = scaled / det;
+            if (!ray_t.surrounds(t)) return false;
+
+            b1 = e1 / det;
+            b2 = e2 / det;
+            return true;
+        }
+
+        void vertex_offset(uint32_t i, const watertight_ray& wr, double* out) const {
+            out[0] = mesh.x[i] - wr.origin[0];
+            out[1] = mesh.y[i] - wr.origin[1];
+            out[2] = mesh.z[i] - wr.origin[2];
+        }
+
+        point3 position(uint32_t i) const { return point3(mesh.x[i], mesh.y[i], mesh.z[i]); }
+
+        void set_hit(uint32_t triangle, const ray& r, double b1, double b2, hit_record& rec) const {
+            const auto* tri = &mesh.indices[3 * triangle];
+            auto b0 = 1 - b1 - b2;
+            auto p0 = position(tri[0]);
+
+            rec.p = r.at(rec.t);
+            rec.mat = mat.get();
+            rec.object = this;
+            rec.set_face_normal(r, unit_vector(cross(position(tri[1]) - p0, position(tri[2]) - p0)));
+
+            if (!mesh.nx.empty()) {
+                // The shading normal, turned to the side of the surface the ray hit.
+                vec3 n;
+                for (int k = 0; k < 3; k++) {
+                    auto w = (k == 0) ? b0 : (k == 1) ? b1 : b2;
+                    n += w * vec3(mesh.nx[tri[k]], mesh.ny[tri[k]], mesh.nz[tri[k]]);
+                }
+                if (n.length_squared() > 0) rec.normal = rec.front_face ? unit_vector(n) : -unit_vector(n);
+            }
+
+            if (!mesh.u.empty()) {
+                rec.u = b0 * mesh.u[tri[0]] + b1 * mesh.u[tri[1]] + b2 * mesh.u[tri[2]];
+                rec.v = b0 * mesh.v[tri[0]] + b1 * mesh.v[tri[1]] + b2 * mesh.v[tri[2]];
+            } else {
+                rec.u = b1;
+                rec.v = b2;
+            }
+        }
+
+        void build() {
+            auto count = mesh.triangle_count();
+            if (count == 0) return;
+
+            std::vector<bvh_node::bvh_prim> prims;
+            prims.reserve(count);
+
+            for (size_t i = 0; i < count; i++) {
+                const auto* tri = &mesh.indices[3 * i];
+                auto box = aabb(aabb(position(tri[0]), position(tri[1])), aabb(position(tri[2]), position(tri[2]))).pad();
+                bbox = aabb(bbox, box);
+                prims.push_back({ box, box.centroid(), i });
+            }
+
+            std::vector<uint32_t> order;
+            order.reserve(count);
+            nodes.reserve(count);
+
+            auto make_leaf = [&](uint32_t index, const std::vector<bvh_node::bvh_prim>& refs, size_t first, size_t last, int) {
+                nodes[index].offset = static_cast<uint32_t>(order.size());
+                nodes[index].count = static_cast<uint16_t>(last - first);
+                for (size_t i = first; i < last; i++) order.push_back(static_cast<uint32_t>(refs[i].index));
+            };
+
+            bvh_node::build(nodes, prims, 0, count, 1, bvh_node::max_leaf_size, make_leaf, nullptr);
+            std::vector<bvh_node::bvh_prim>().swap(prims);
+
+            std::vector<uint32_t> sorted(mesh.indices.size());
+            for (size_t i = 0; i < count; i++)
+                std::copy_n(&mesh.indices[3 * order[i]], 3, &sorted[3 * i]);
+            mesh.indices.swap(sorted);
+
+            // Vertices are renumbered in the order the sorted triangles first use them, so the
+            // vertices a leaf reads are near each other in memory too. Unused ones are dropped.
+            std::vector<uint32_t> renumber(mesh.vertex_count(), UINT32_MAX);
+            uint32_t used = 0;
+            for (auto& i : mesh.indices) {
+                if (renumber[i] == UINT32_MAX) renumber[i] = used++;
+                i = renumber[i];
+            }
+
+            for (auto* array : { &mesh.x, &mesh.y, &mesh.z, &mesh.nx, &mesh.ny, &mesh.nz, &mesh.u, &mesh.v }) {
+                if (array->empty()) continue;
+                std::vector<float> moved(used);
+                for (size_t i = 0; i < renumber.size(); i++)
+                    if (renumber[i] != UINT32_MAX) moved[renumber[i]] = (*array)[i];
+                array->swap(moved);
+            }
+        }
+
+        // File loading. Both parsers work on the whole file in memory, and write the
+        // attributes straight into the mesh's arrays.
+
+        static bool read_file(const std::string& filename, std::string& text) {
+            auto file = std::fopen(filename.c_str(), "rb");
+            if (!file) return false;
+
+            std::fseek(file, 0, SEEK_END);
+            auto size = std::ftell(file);
+            std::fseek(file, 0, SEEK_SET);
+
+            text.resize(size > 0 ? static_cast<size_t>(size) : 0);
+            auto read = std::fread(text.data(), 1, text.size(), file);
+            std::fclose(file);
+            return size >= 0 && read == text.size();
+        }
+
+        struct obj_corner {
+            int32_t v, vt, vn;      // Zero-based, or -1 where the face leaves it out
+
+            bool operator==(const obj_corner& o) const { return v == o.v && vt == o.vt && vn == o.vn; }
+        };
+
+        struct obj_corner_hash {
+            size_t operator()(const obj_corner& c) const {
+                uint64_t h = static_cast<uint32_t>(c.v);
+                h = h * 0x9e3779b97f4a7c15ull + static_cast<uint32_t>(c.vt);
+                h = h * 0x9e3779b97f4a7c15ull + static_cast<uint32_t>(c.vn);
+                return static_cast<size_t>(h ^ (h >> 29));
+            }
+        };
+
+        static const char* skip_blanks(const char* p, const char* end) {
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            return p;
+        }
+
+        static bool parse_float(const char*& p, const char* end, float& value) {
+            p = skip_blanks(p, end);
+            if (p < end && *p == '+') p++;
+            auto result = std::from_chars(p, end, value);
+            if (result.ec != std::errc()) return false;
+            p = result.ptr;
+            return true;
+        }
+
+        static bool parse_index(const char*& p, const char* end, size_t count, int32_t& index) {
+            // A one-based index, or a negative one counting back from the latest element.
+            bool negative = (p < end && *p == '-');
+            if (negative) p++;
+
+            int64_t value = 0;
+            auto result = std::from_chars(p, end, value);
+            if (result.ec != std::errc() || value == 0) return false;
+            p = result.ptr;
+
+            value = negative ? static_cast<int64_t>(count) - value : value - 1;
+            if (value < 0 || value > INT32_MAX) return false;
+            index = static_cast<int32_t>(value);
+            return true;
+        }
+
+        static bool parse_obj(const std::string& text, mesh_arrays& out) {
+            // Positions, texture coordinates, normals and faces; everything else (groups,
+            // materials, lines) is skipped. Polygons are split into fans of triangles.
+            std::vector<float> texcoords, normals;
+            std::vector<obj_corner> corners, polygon;
+            size_t texcoord_count = 0, normal_count = 0;
+
+            const char* p = text.data();
+            const char* end = p + text.size();
+
+            while (p < end) {
+                p = skip_blanks(p, end);
+                auto next = static_cast<const char*>(std::memchr(p, '\n', end - p));
+                auto line_end = next ? next : end;
+
+                if (line_end - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+                    float x, y, z;
+                    p++;
+                    if (!parse_float(p, line_end, x) || !parse_float(p, line_end, y) || !parse_float(p, line_end, z))
+                        return false;
+                    out.x.push_back(x);
+                    out.y.push_back(y);
+                    out.z.push_back(z);
+                } else if (line_end - p >= 3 && p[0] == 'v' && p[1] == 't') {
+                    float u, v = 0;
+                    p += 2;
+                    if (!parse_float(p, line_end, u)) return false;
+                    parse_float(p, line_end, v);
+                    texcoords.push_back(u);
+                    texcoords.push_back(v);
+                    texcoord_count++;
+                } else if (line_end - p >= 3 && p[0] == 'v' && p[1] == 'n') {
+                    float x, y, z;
+                    p += 2;
+                    if (!parse_float(p, line_end, x) || !parse_float(p, line_end, y) || !parse_float(p, line_end, z))
+                        return false;
+                    normals.push_back(x);
+                    normals.push_back(y);
+                    normals.push_back(z);
+                    normal_count++;
+                } else if (line_end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+                    polygon.clear();
+                    p++;
+
+                    while (true) {
+                        p = skip_blanks(p, line_end);
+                        if (p == line_end || *p == '\r' || *p == '#') break;
+
+                        obj_corner c = { -1, -1, -1 };
+                        if (!parse_index(p, line_end, out.x.size(), c.v)) return false;
+                        if (p < line_end && *p == '/') {
+                            p++;
+                            if (p < line_end && *p != '/' && !parse_index(p, line_end, texcoord_count, c.vt))
+                                return false;
+                            if (p < line_end && *p == '/') {
+                                p++;
+                                if (!parse_index(p, line_end, normal_count, c.vn)) return false;
+                            }
+                        }
+                        polygon.push_back(c);
+                    }
+
+                    for (size_t i = 2; i < polygon.size(); i++) {
+                        corners.push_back(polygon[0]);
+                        corners.push_back(polygon[i - 1]);
+                        corners.push_back(polygon[i]);
+                    }
+                }
+
+                p = next ? next + 1 : end;
+            }
+
+            // Faces may refer ahead to vertices declared later, so the indices are checked once
+            // everything is read.
+            bool has_texcoords = false, has_normals = false, shared = true;
+            for (const auto& c : corners) {
+                if (static_cast<size_t>(c.v) >= out.x.size() || c.vt >= static_cast<int64_t>(texcoord_count)
+                        || c.vn >= static_cast<int64_t>(normal_count))
+                    return false;
+                has_texcoords |= c.vt >= 0;
+                has_normals |= c.vn >= 0;
+                shared &= (c.vt < 0 || c.vt == c.v) && (c.vn < 0 || c.vn == c.v);
+            }
+            if (shared) {
+                // Every attribute a corner has uses its position's index, so the arrays are
+                // already indexed together and the positions can stay as they are.
+                for (const auto& c : corners) shared &= (c.vt >= 0) == has_texcoords && (c.vn >= 0) == has_normals;
+            }
+
+            auto vertex_count = out.x.size();
+            auto add_attributes = [&](const obj_corner& c) {
+                if (has_texcoords) {
+                    out.u.push_back(c.vt >= 0 ? texcoords[2 * c.vt] : 0.0f);
+                    out.v.push_back(c.vt >= 0 ? texcoords[2 * c.vt + 1] : 0.0f);
+                }
+                if (has_normals) {
+                    out.nx.push_back(c.vn >= 0 ? normals[3 * c.vn] : 0.0f);
+                    out.ny.push_back(c.vn >= 0 ? normals[3 * c.vn + 1] : 0.0f);
+                    out.nz.push_back(c.vn >= 0 ? normals[3 * c.vn + 2] : 0.0f);
+                }
+            };
+
+            out.indices.reserve(corners.size());
+
+            if (shared) {
+                for (size_t i = 0; i < vertex_count; i++) {
+                    obj_corner c = { static_cast<int32_t>(i), -1, -1 };
+                    if (i < texcoord_count) c.vt = c.v;
+                    if (i < normal_count) c.vn = c.v;
+                    add_attributes(c);
+                }
+                for (const auto& c : corners) out.indices.push_back(static_cast<uint32_t>(c.v));
+                return true;
+            }
+
+            // Otherwise each distinct combination of position, texture coordinate and normal
+            // becomes a vertex of its own.
+            std::vector<float> px, py, pz;
+            px.swap(out.x);
+            py.swap(out.y);
+            pz.swap(out.z);
+
+            std::unordered_map<obj_corner, uint32_t, obj_corner_hash> vertices;
+            vertices.reserve(vertex_count);
+
+            for (const auto& c : corners) {
+                auto inserted = vertices.emplace(c, static_cast<uint32_t>(out.x.size()));
+                if (inserted.second) {
+                    out.x.push_back(px[c.v]);
+                    out.y.push_back(py[c.v]);
+                    out.z.push_back(pz[c.v]);
+                    add_attributes(c);
+                }
+                out.indices.push_back(inserted.first->second);
+            }
+
+            return true;
+        }
+
+        enum ply_type { ply_int8, ply_uint8, ply_int16, ply_uint16, ply_int32, ply_uint32, ply_float32, ply_float64 };
+
+        struct ply_property {
+            std::string name;
+            ply_type type;
+            bool is_list = false;
+            ply_type count_type = ply_uint8;    // Lists: the type of the length before the items
+        };
+
+        struct ply_element {
+            std::string name;
+            size_t count = 0;
+            std::vector<ply_property> properties;
+        };
+
+        static bool ply_type_of(const std::string& name, ply_type& type) {
+            static const std::pair<const char*, ply_type> names[] = {
+                { "char", ply_int8 }, { "int8", ply_int8 }, { "uchar", ply_uint8 }, { "uint8", ply_uint8 },
+                { "short", ply_int16 }, { "int16", ply_int16 }, { "ushort", ply_uint16 }, { "uint16", ply_uint16 },
+                { "int", ply_int32 }, { "int32", ply_int32 }, { "uint", ply_uint32 }, { "uint32", ply_uint32 },
+                { "float", ply_float32 }, { "float32", ply_float32 }, { "double", ply_float64 }, { "float64", ply_float64 },
+            };
+
+            for (const auto& n : names) {
+                if (name == n.first) {
+                    type = n.second;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static size_t ply_size(ply_type type) {
+            static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+            return sizes[type];
+        }
+
+        static bool ply_read(const char*& p, const char* end, ply_type type, bool swap, double& value) {
+            auto size = ply_size(type);
+            if (static_cast<size_t>(end - p) < size) return false;
+
+            unsigned char bytes[8];
+            std::memcpy(bytes, p, size);
+            if (swap) std::reverse(bytes, bytes + size);
+            p += size;
+
+            switch (type) {
+                case ply_int8:    { int8_t x;   std::memcpy(&x, bytes, 1); value = x; break; }
+                case ply_uint8:   { uint8_t x;  std::memcpy(&x, bytes, 1); value = x; break; }
+                case ply_int16:   { int16_t x;  std::memcpy(&x, bytes, 2); value = x; break; }
+                case ply_uint16:  { uint16_t x; std::memcpy(&x, bytes, 2); value = x; break; }
+                case ply_int32:   { int32_t x;  std::memcpy(&x, bytes, 4); value = x; break; }
+                case ply_uint32:  { uint32_t x; std::memcpy(&x, bytes, 4); value = x; break; }
+                case ply_float32: { float x;    std::memcpy(&x, bytes, 4); value = x; break; }
+                case ply_float64: { double x;   std::memcpy(&x, bytes, 8); value = x; break; }
+            }
+            return true;
+        }
+
+        static bool parse_ply(const std::string& text, mesh_arrays& out) {
+            // Binary PLY, in either byte order. Vertices take x, y, z, nx, ny, nz and u, v (or
+            // s, t) from the vertex element; faces take their vertex_indices list. Other
+            // properties and elements are read past.
+            auto header_end = text.find("end_header");
+            if (text.compare(0, 3, "ply") != 0 || header_end == std::string::npos) return false;
+
+            std::istringstream header(text.substr(0, header_end));
+            std::vector<ply_element> elements;
+            std::string line;
+            bool little_endian = true;
+
+            while (std::getline(header, line)) {
+                std::istringstream words(line);
+                std::string keyword;
+                words >> keyword;
+
+                if (keyword == "format") {
+                    std::string format;
+                    words >> format;
+                    if (format == "binary_little_endian") little_endian = true;
+                    else if (format == "binary_big_endian") little_endian = false;
+                    else return false;
+                } else if (keyword == "element") {
+                    ply_element element;
+                    words >> element.name >> element.count;
+                    elements.push_back(element);
+                } else if (keyword == "property") {
+                    if (elements.empty()) return false;
+                    ply_property property;
+                    std::string type;
+                    words >> type;
+
+                    if (type == "list") {
+                        std::string count_type, item_type;
+                        words >> count_type >> item_type;
+                        property.is_list = true;
+                        if (!ply_type_of(count_type, property.count_type) || !ply_type_of(item_type, property.type))
+                            return false;
+                    } else if (!ply_type_of(type, property.type)) {
+                        return false;
+                    }
+
+                    words >> property.name;
+                    elements.back().properties.push_back(property);
+                }
+            }
+
+            uint16_t probe = 1;
+            unsigned char first_byte;
+            std::memcpy(&first_byte, &probe, 1);
+            bool swap = (first_byte == 1) != little_endian;
+
+            auto data_start = text.find('\n', header_end);
+            if (data_start == std::string::npos) return false;
+
+            const char* p = text.data() + data_start + 1;
+            const char* end = text.data() + text.size();
+            std::vector<uint32_t> polygon;
+            size_t vertex_count = 0;
+
+            for (const auto& element : elements) {
+                // Where each property's value goes: x, y, z, nx, ny, nz, u, v, or nowhere.
+                static const char* const slot_names[][3] = {
+                    { "x", "", "" }, { "y", "", "" }, { "z", "", "" },
+                    { "nx", "", "" }, { "ny", "", "" }, { "nz", "", "" },
+                    { "u", "s", "texture_u" }, { "v", "t", "texture_v" },
+                };
+                std::vector<float>* slots[] = { &out.x, &out.y, &out.z, &out.nx, &out.ny, &out.nz, &out.u, &out.v };
+
+                bool is_vertex = element.name == "vertex";
+                bool is_face = element.name == "face";
+                std::vector<int> slot(element.properties.size(), -1);
+                int face_list = -1;
+
+                for (size_t i = 0; i < element.properties.size(); i++) {
+                    const auto& property = element.properties[i];
+                    if (is_vertex && !property.is_list) {
+                        for (int s = 0; s < 8; s++) {
+                            for (const auto* name : slot_names[s])
+                                if (*name && property.name == name) slot[i] = s;
+                        }
+                    }
+                    if (is_face && property.is_list && (property.name == "vertex_indices" || property.name == "vertex_index"))
+                        face_list = static_cast<int>(i);
+                }
+
+                if (is_vertex) {
+                    vertex_count = element.count;
+                    bool found[8] = {};
+                    for (auto s : slot) if (s >= 0) found[s] = true;
+                    if (!found[0] || !found[1] || !found[2]) return false;
+
+                    // Attributes come whole or not at all.
+                    for (int s = 0; s < 8; s++) {
+                        bool keep = found[s] && (s < 3 || (s < 6 ? found[3] && found[4] && found[5] : found[6] && found[7]));
+                        if (keep) slots[s]->resize(element.count);
+                        else for (auto& k : slot) if (k == s) k = -1;
+                    }
+                }
+
+                if (is_face) out.indices.reserve(out.indices.size() + 3 * element.count);
+
+                for (size_t n = 0; n < element.count; n++) {
+                    for (size_t i = 0; i < element.properties.size(); i++) {
+                        const auto& property = element.properties[i];
+                        double value;
+
+                        if (!property.is_list) {
+                            if (!ply_read(p, end, property.type, swap, value)) return false;
+                            if (slot[i] >= 0) (*slots[slot[i]])[n] = static_cast<float>(value);
+                            continue;
+                        }
+
+                        double length;
+                        if (!ply_read(p, end, property.count_type, swap, length) || length < 0) return false;
+                        auto items = static_cast<size_t>(length);
+
+                        if (static_cast<int>(i) != face_list) {
+                            if (static_cast<size_t>(end - p) < items * ply_size(property.type)) return false;
+                            p += items * ply_size(property.type);
+                            continue;
+                        }
+
+                        polygon.clear();
+                        for (size_t k = 0; k < items; k++) {
+                            if (!ply_read(p, end, property.type, swap, value)) return false;
+                            if (value < 0 || value >= vertex_count) return false;
+                            polygon.push_back(static_cast<uint32_t>(value));
+                        }
+
+                        for (size_t k = 2; k < polygon.size(); k++) {
+                            out.indices.push_back(polygon[0]);
+                            out.indices.push_back(polygon[k - 1]);
+                            out.indices.push_back(polygon[k]);
+                        }
+                    }
+                }
+            }
+
+            return !out.x.empty();
+        }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,392 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "hittable.h"
+
+#include <cstdint>
+#include <vector>
+
+// The slab tests use SSE for 4-wide nodes and AVX2 for 8-wide ones when the compiler targets
+// them (AArch64 NEON for 4-wide), and a scalar loop otherwise. Define RT_BVH_SCALAR to force
+// the scalar loop.
+#if !defined(RT_BVH_SCALAR)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RT_BVH_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RT_BVH_SSE 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RT_BVH_NEON 1
+#endif
+#endif
+
+template <int W>
+struct alignas(64) wide_node {
+    static constexpr int width = W;
+
+    float bounds[2][3][W];  // [lower/upper][axis][child], rounded outwards to float
+    uint32_t child[W];      // An interior child's node, or a leaf child's first primitive
+    uint8_t count[W];       // Primitives in a leaf child, 0 for an interior or empty lane
+
+    void set_bounds(const bvh_node::linear_node* const* children, int n) {
+        // Lanes past n get an inverted box that no ray enters.
+        for (int i = 0; i < W; i++) {
+            for (int a = 0; a < 3; a++) {
+                bounds[0][a][i] = i < n ? children[i]->lower[a] : std::numeric_limits<float>::infinity();
+                bounds[1][a][i] = i < n ? children[i]->upper[a] : -std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+};
+
+struct wide_ray {
+    // The ray in float, with its inverse direction and which side of each slab it enters.
+    // Rounding the origin moves every slab distance on an axis by up to slack, which is
+    // |o - float(o)| / |d| rounded up; it is absolute, so it is not covered by wide_slab_robust.
+    float origin[3];
+    float inv_direction[3];
+    float slack[3];
+    int near_side[3];
+
+    wide_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            auto o = r.origin()[a];
+            auto inv = 1 / r.direction()[a];
+
+            origin[a] = static_cast<float>(o);
+            inv_direction[a] = static_cast<float>(inv);
+            near_side[a] = inv_direction[a] < 0 ? 1 : 0;
+
+            auto error = std::fabs(o - origin[a]) * std::fabs(inv);
+            slack[a] = (error == 0 || std::isinf(inv))
+                     ? 0 : std::nextafter(static_cast<float>(error), std::numeric_limits<float>::infinity());
+        }
+    }
+};
+
+// Each slab distance takes three float roundings (the inverse, the subtraction and the
+// multiply). Far distances are scaled up by their worst case and, with near distances moved
+// back by the origin's slack, the float tests never reject a box the exact test would hit.
+constexpr float wide_slab_robust = 1 + 2 * 3 * 0x1p-24f / (1 - 3 * 0x1p-24f);
+
+template <int W>
+inline int slab_test_scalar(const wide_node<W>& node, const wide_ray& r, float tmin, float tmax, float* tnear) {
+    int mask = 0;
+
+    for (int i = 0; i < W; i++) {
+        auto t0 = tmin, t1 = tmax;
+
+        for (int a = 0; a < 3; a++) {
+            auto n = (node.bounds[r.near_side[a]][a][i] - r.origin[a]) * r.inv_direction[a];
+            auto f = (node.bounds[1 - r.near_side[a]][a][i] - r.origin[a]) * r.inv_direction[a];
+
+            n -= r.slack[a];
+            f = f * wide_slab_robust + r.slack[a];
+
+            if (n > t0) t0 = n;
+            if (f < t1) t1 = f;
+        }
+
+        tnear[i] = t0;
+        if (t0 < t1) mask |= 1 << i;
+    }
+
+    return mask;
+}
+
+inline int slab_test(const wide_node<4>& node, const wide_ray& r, float tmin, float tmax, float* tnear) {
+    // Returns a bit per child whose box the ray enters within [tmin, tmax], and writes each
+    // child's entry distance to tnear.
+#if defined(RT_BVH_SSE)
+    auto t0 = _mm_set1_ps(tmin);
+    auto t1 = _mm_set1_ps(tmax);
+    auto robust = _mm_set1_ps(wide_slab_robust);
+
+    for (int a = 0; a < 3; a++) {
+        auto origin = _mm_set1_ps(r.origin[a]);
+        auto inv = _mm_set1_ps(r.inv_direction[a]);
+        auto slack = _mm_set1_ps(r.slack[a]);
+        auto n = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.near_side[a]][a]), origin), inv);
+        auto f = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - r.near_side[a]][a]), origin), inv);
+
+        // With a NaN operand these return the second one, so 0 * inf keeps the current limit.
+        t0 = _mm_max_ps(_mm_sub_ps(n, slack), t0);
+        t1 = _mm_min_ps(_mm_add_ps(_mm_mul_ps(f, robust), slack), t1);
+    }
+
+    _mm_storeu_ps(tnear, t0);
+    return _mm_movemask_ps(_mm_cmplt_ps(t0, t1));
+#elif defined(RT_BVH_NEON)
+    auto t0 = vdupq_n_f32(tmin);
+    auto t1 = vdupq_n_f32(tmax);
+    auto robust = vdupq_n_f32(wide_slab_robust);
+
+    for (int a = 0; a < 3; a++) {
+        auto origin = vdupq_n_f32(r.origin[a]);
+        auto inv = vdupq_n_f32(r.inv_direction[a]);
+        auto slack = vdupq_n_f32(r.slack[a]);
+        auto n = vmulq_f32(vsubq_f32(vld1q_f32(node.bounds[r.near_side[a]][a]), origin), inv);
+        auto f = vmulq_f32(vsubq_f32(vld1q_f32(node.bounds[1 - r.near_side[a]][a]), origin), inv);
+
+        t0 = vmaxnmq_f32(vsubq_f32(n, slack), t0);
+        t1 = vminnmq_f32(vaddq_f32(vmulq_f32(f, robust), slack), t1);
+    }
+
+    vst1q_f32(tnear, t0);
+    static const uint32_t bits[4] = { 1, 2, 4, 8 };
+    return static_cast<int>(vaddvq_u32(vandq_u32(vcltq_f32(t0, t1), vld1q_u32(bits))));
+#else
+    return slab_test_scalar(node, r, tmin, tmax, tnear);
+#endif
+}
+
+inline int slab_test(const wide_node<8>& node, const wide_ray& r, float tmin, float tmax, float* tnear) {
+#if defined(RT_BVH_AVX2)
+    auto t0 = _mm256_set1_ps(tmin);
+    auto t1 = _mm256_set1_ps(tmax);
+    auto robust = _mm256_set1_ps(wide_slab_robust);
+
+    for (int a = 0; a < 3; a++) {
+        auto origin = _mm256_set1_ps(r.origin[a]);
+        auto inv = _mm256_set1_ps(r.inv_direction[a]);
+        auto slack = _mm256_set1_ps(r.slack[a]);
+        auto n = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[r.near_side[a]][a]), origin), inv);
+        auto f = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1 - r.near_side[a]][a]), origin), inv);
+
+        t0 = _mm256_max_ps(_mm256_sub_ps(n, slack), t0);
+        t1 = _mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(f, robust), slack), t1);
+    }
+
+    _mm256_storeu_ps(tnear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LT_OQ));
+#else
+    return slab_test_scalar(node, r, tmin, tmax, tnear);
+#endif
+}
+
+template <int W>
+inline int collapse_children(const std::vector<bvh_node::linear_node>& binary, uint32_t root, uint32_t* lanes) {
+    // Picks the binary nodes that become the children of a W-wide node standing in for root:
+    // starting from root's two children, the interior child with the largest surface area is
+    // replaced by its own two until there are W. Returns how many lanes were filled.
+    auto area = [](const bvh_node::linear_node& node) {
+        double dx = node.upper[0] - node.lower[0];
+        double dy = node.upper[1] - node.lower[1];
+        double dz = node.upper[2] - node.lower[2];
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    };
+
+    int n = 0;
+
+    if (binary[root].count > 0) {
+        lanes[n++] = root;
+    } else {
+        lanes[n++] = root + 1;
+        lanes[n++] = binary[root].offset;
+    }
+
+    while (n < W) {
+        int best = -1;
+        double best_area = -1;
+        for (int i = 0; i < n; i++) {
+            const auto& node = binary[lanes[i]];
+            if (node.count > 0) continue;
+
+            if (area(node) > best_area) {
+                best = i;
+                best_area = area(node);
+            }
+        }
+
+        if (best < 0) break;
+
+        auto opened = lanes[best];
+        lanes[best] = opened + 1;
+        lanes[n++] = binary[opened].offset;
+    }
+
+    return n;
+}
+
+template <typename Node>
+class basic_wide_bvh : public hittable {
+    public:
+        // A W-wide BVH collapsed from a binary bvh_node: each wide node takes the place of a
+        // binary node and the subtrees below it, opening the largest interior child until it
+        // has W children. Traversal tests all of a node's children in one slab test and visits
+        // the ones the ray enters nearest first. Node is the storage format of the children's
+        // boxes, and comes with a slab_test overload.
+        basic_wide_bvh(const bvh_node& tree)
+          : objects(tree.tree_objects()), primitives(tree.tree_primitives()), bbox(tree.bounding_box()) {
+            const auto& binary = tree.tree_nodes();
+            if (binary.empty()) return;
+
+            nodes.reserve(binary.size() / (W - 1) + 1);
+            collapse(binary, 0);
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (nodes.empty()) return false;
+
+            wide_ray wr(r);
+            stack_entry stack[stack_size];
+            int top = 0;
+            bool hit_anything = false;
+
+            stack[top++] = { 0, 0, near_limit(ray_t.min) };
+
+            while (top > 0) {
+                auto entry = stack[--top];
+                if (entry.tnear > far_limit(ray_t.max) * wide_slab_robust) continue;
+
+                if (entry.count > 0) {
+                    for (uint32_t i = entry.child; i < entry.child + entry.count; i++) {
+                        if (primitives[i].hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                    continue;
+                }
+
+                const auto& node = nodes[entry.child];
+                alignas(32) float tnear[W];
+                auto mask = slab_test(node, wr, near_limit(ray_t.min), far_limit(ray_t.max), tnear);
+
+                // Push the children the ray enters farthest first, so the nearest is popped next.
+                stack_entry hits[W];
+                int n = 0;
+                for (int i = 0; i < W; i++) {
+                    if (!(mask & (1 << i))) continue;
+
+                    stack_entry e = { node.child[i], node.count[i], tnear[i] };
+                    int j = n++;
+                    for (; j > 0 && hits[j-1].tnear < e.tnear; j--) hits[j] = hits[j-1];
+                    hits[j] = e;
+                }
+
+                for (int i = 0; i < n; i++) stack[top++] = hits[i];
+            }
+
+            return hit_anything;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            wide_ray wr(r);
+            uint32_t stack[stack_size];
+            int top = 0;
+            auto tmin = near_limit(ray_t.min);
+            auto tmax = far_limit(ray_t.max);
+
+            stack[top++] = 0;
+
+            while (top > 0) {
+                const auto& node = nodes[stack[--top]];
+                alignas(32) float tnear[W];
+                auto mask = slab_test(node, wr, tmin, tmax, tnear);
+
+                for (int i = 0; i < W; i++) {
+                    if (!(mask & (1 << i))) continue;
+
+                    if (node.count[i] == 0) {
+                        stack[top++] = node.child[i];
+                        continue;
+                    }
+
+                    for (uint32_t k = node.child[i]; k < node.child[i] + node.count[i]; k++)
+                        if (primitives[k].occluded(r, ray_t)) return true;
+                }
+            }
+
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            collect_unique_lights(objects, lights);
+        }
+
+        size_t node_count() const { return nodes.size(); }
+        size_t node_bytes() const { return nodes.size() * sizeof(Node); }
+
+    private:
+        static constexpr int W = Node::width;
+
+        struct stack_entry {
+            uint32_t child;
+            uint32_t count;
+            float tnear;
+        };
+
+        // The binary tree is at most 64 deep, and each level of it can leave W - 1 entries.
+        static constexpr int stack_size = 64 * (W - 1) + 1;
+
+        std::vector<Node> nodes;
+        std::vector<shared_ptr<hittable>> objects;
+        std::vector<primitive_ref> primitives;
+        aabb bbox;
+
+        static float near_limit(double t) {
+            // These round the double limits outwards to float, so the float test is never the
+            // stricter one.
+            auto f = static_cast<float>(t);
+            return (f > t) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+        }
+
+        static float far_limit(double t) {
+            auto f = static_cast<float>(t);
+            return (f < t) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+        }
+
+        uint32_t collapse(const std::vector<bvh_node::linear_node>& binary, uint32_t root) {
+            uint32_t lanes[W];
+            auto n = collapse_children<W>(binary, root, lanes);
+
+            auto index = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
+
+            const bvh_node::linear_node* children[W];
+            for (int i = 0; i < n; i++) children[i] = &binary[lanes[i]];
+
+            Node node = {};
+            node.set_bounds(children, n);
+
+            for (int i = 0; i < n; i++) {
+                const auto& child = binary[lanes[i]];
+                node.count[i] = static_cast<uint8_t>(child.count);
+                node.child[i] = child.count > 0 ? child.offset : collapse(binary, lanes[i]);
+            }
+
+            nodes[index] = node;
+            return index;
+        }
+};
+
+template <int W>
+using wide_bvh = basic_wide_bvh<wide_node<W>>;
+
+inline int native_bvh_width() {
+    // The widest node the compiled slab test handles in one instruction.
+#if defined(RT_BVH_AVX2)
+    return 8;
+#else
+    return 4;
+#endif
+}
+
+inline shared_ptr<hittable> make_wide_bvh(const bvh_node& tree, int width = 0) {
+    // width 0 picks native_bvh_width(); any other value than 8 gives 4-wide nodes.
+    if (width == 0) width = native_bvh_width();
+    if (width == 8) return make_shared<wide_bvh<8>>(tree);
+    return make_shared<wide_bvh<4>>(tree);
+}
+
+#endif
\ No newline at end of file